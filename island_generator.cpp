@@ -44,39 +44,1130 @@ Usage: <exe> [-s seed]
 #include <iostream>
 #include <fstream>
 #include "termcolor.hpp"
+#ifdef ISLANDGEN_LIBRARY
+#include "islandgen.h"
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <iomanip>
 #include <time.h>
 #include <math.h>
 #include <string.h>
+#include <limits.h>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdarg.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#define ISLAND_RESULT_CACHE 1 //--cache-dir needs mmap and POSIX directory calls
+#define ISLAND_FUSED_PIPELINE 1 //--fused writes rows in place with pwrite
+#define ISLAND_SHARDS 1 //--shards forks worker processes that share their grids through mmap
+#define ISLAND_TERMINAL_SIZE 1 //--view fit asks the terminal for its size with ioctl
+#define ISLAND_HEIGHTMAP 1 //--heightmap maps its file with mmap
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#define ISLAND_PERF_COUNTERS 1 //--counters reads hardware counters through perf_event_open
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ISLAND_AVX2_KERNEL 1 //the lockstep walker has an AVX2 path picked at run time
+#endif
 using std::cout;
 using std::endl;
 using std::cin;
 using std::setw;
 using std::ofstream;
+using std::vector;
 using namespace termcolor; 
 
+//Struct DropSampler is an alias table over every in-bounds cell of the clipped drop-zone disk
+//Each slot keeps its own cell with probability threshold/(RAND_MAX+1) and otherwise falls through to its alias
+struct DropSampler
+{
+    vector<unsigned int> cell;      //row-major index of the cell owning each slot
+    vector<unsigned int> alias;     //row-major index of the slot's alias cell
+    vector<unsigned int> threshold; //keep probability scaled to rand()'s range
+};
+
+//Direction offsets in the order of the Moore's neighborhood numbering used by the walk (N, NE, E, SE, S, SW, W, NW)
+//The opposite of direction d is (d + 4) & 7
+const int DIR_X[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+const int DIR_Y[8] = {-1, -1, 0, 1, 1, 1, 0, -1};
+
+//Neighborhoods a particle can move in, selected with --neighborhood
+//Each policy lists the directions open from a cell on an even (directions[0]) or odd (directions[1]) row. Every one
+//is symmetric: when d is open from a cell, (d + 4) & 7 is open from the neighbor it leads to, so the valid-direction
+//bits of the walk only ever hold open directions
+enum Neighborhood { NEIGHBORHOOD_MOORE, NEIGHBORHOOD_VON_NEUMANN, NEIGHBORHOOD_HEX };
+
+//Struct Moore8 is all eight surrounding cells
+struct Moore8
+{
+    static constexpr int count = 8;
+    static constexpr int directions[2][8] = {{0, 1, 2, 3, 4, 5, 6, 7}, {0, 1, 2, 3, 4, 5, 6, 7}};
+    static constexpr const char* name = "moore";
+};
+
+//Struct VonNeumann4 is the four edge-sharing cells
+struct VonNeumann4
+{
+    static constexpr int count = 4;
+    static constexpr int directions[2][4] = {{0, 2, 4, 6}, {0, 2, 4, 6}};
+    static constexpr const char* name = "vonneumann";
+};
+
+//Struct Hex6 treats the grid as hexagons with the odd rows shifted half a cell right: the diagonal neighbors lean
+//west on even rows and east on odd rows
+struct Hex6
+{
+    static constexpr int count = 6;
+    static constexpr int directions[2][6] = {{0, 2, 4, 5, 6, 7}, {0, 1, 2, 3, 4, 6}};
+    static constexpr const char* name = "hex";
+};
+
+//Memory layouts for the count grid walked by makeParticleMap, selected with --layout
+//Every layout keeps each cell's 3x3 neighborhood closer together than rows of width*4 bytes do on wide maps
+enum GridLayout { LAYOUT_ROWS, LAYOUT_TILE8, LAYOUT_TILE16, LAYOUT_MORTON };
+
+//Struct RowLayout is the plain row-major order used everywhere outside the walk
+struct RowLayout
+{
+    int width;
+    long long size;
+    RowLayout(int width, int height) : width(width), size((long long) width * height) {}
+    long long index(int x, int y) const { return (long long) y * width + x; }
+};
+
+//Struct TileLayout stores the grid as row-major tiles of (1 << Shift) x (1 << Shift) cells, each tile row-major inside
+//The grid is padded up to whole tiles
+template<int Shift>
+struct TileLayout
+{
+    int tilesX;
+    long long size;
+    TileLayout(int width, int height) : tilesX((width + (1 << Shift) - 1) >> Shift),
+        size((long long) tilesX * ((height + (1 << Shift) - 1) >> Shift) << (2 * Shift)) {}
+    long long index(int x, int y) const
+    {
+        const int mask = (1 << Shift) - 1;
+        return (((long long) (y >> Shift) * tilesX + (x >> Shift)) << (2 * Shift)) | ((y & mask) << Shift) | (x & mask);
+    }
+};
+
+//Struct MortonLayout stores the grid as row-major 64x64 blocks with Z-order inside each block
+//Blocking keeps the padding bounded on long thin maps where a single Z-curve would cover a huge square
+struct MortonLayout
+{
+    int blocksX;
+    long long size;
+    unsigned short spread[64]; //bits of a 6-bit coordinate moved to the even bit positions
+    MortonLayout(int width, int height) : blocksX((width + 63) >> 6), size((long long) blocksX * ((height + 63) >> 6) << 12)
+    {
+        for(int value = 0; value < 64; value++)
+        {
+            spread[value] = 0;
+            for(int bit = 0; bit < 6; bit++)
+                spread[value] |= ((value >> bit) & 1) << (2 * bit);
+        }
+    }
+    long long index(int x, int y) const
+    {
+        return (((long long) (y >> 6) * blocksX + (x >> 6)) << 12) | spread[x & 63] | (spread[y & 63] << 1);
+    }
+};
+
+//Struct FrameRecorder streams --timelapse frames of the raw counts to a file while the walk runs
+//Every keyEvery-th frame is a keyframe with every count; the others list the deposits made since the frame before,
+//which the walk appends to a log as it makes them. Cells are numbered in the walk's own layout order
+struct FrameRecorder
+{
+    FILE* file = 0;
+    int width = 0, height = 0;
+    int layout = LAYOUT_ROWS;
+    long long every = 0;        //particles between frames
+    int keyEvery = 25;
+    long long untilFrame = 0;
+    long long cells = 0;        //cells of the walk's layout, padding included
+    vector<unsigned int> deposits; //cells deposited in since the previous frame, in walk order
+    vector<unsigned char> payload;
+    vector<unsigned long long> offsets; //where each frame starts, written as an index at the end
+    unsigned long long offset = 0;
+    double seconds = 0;         //time spent recording
+};
+
+//Struct TimelapseHeader starts a --timelapse file. Frames follow, each a TimelapseFrame and its payload, then the
+//offsets of all frames (unsigned 64-bit) and a TimelapseIndex, so a player can find any keyframe without a scan
+struct TimelapseHeader
+{
+    char magic[4];              //"ISLT"
+    unsigned int version;
+    int width, height;
+    long long every;
+    int keyEvery;
+    int layout;                 //GridLayout the cells are ordered by
+    long long cells;            //cells per frame, padding of the layout included
+};
+
+//Struct TimelapseFrame starts every frame. A keyframe's payload is every count in layout order as int32, so a player can
+//map it as it is; a delta frame's payload is the deposited cells, each as a zigzag LEB128 varint of its distance from
+//the one before (a particle's path moves to a neighbor, so most take a byte or two)
+struct TimelapseFrame
+{
+    int key;
+    int reserved;
+    long long particles;        //particles dropped when the frame was taken
+    unsigned long long bytes;   //payload size
+};
+
+//Struct TimelapseIndex ends a --timelapse file
+struct TimelapseIndex
+{
+    unsigned long long frames;
+    char magic[8];              //"ISLTINDX"
+};
+
+//Struct WalkMonitor looks at the map every few particles during the walk and can end it early (--converge, --deadline)
+//It samples the counts on a coarse grid of at most MONITOR_SAMPLES x MONITOR_SAMPLES cells, scales them to 0 - 255 the
+//way normalizeMap does, and compares them with the previous check. The mean change in those units is the shape delta
+struct WalkMonitor
+{
+    long long every = 0;        //particles between checks
+    double tolerance = -1;      //stop once the shape delta falls below this, -1 when --converge is off
+    double deadline = -1;       //stop once the walk has run this many seconds, -1 when --deadline is off
+    long long total = 0, dropped = 0, untilCheck = 0;
+    std::chrono::steady_clock::time_point start;
+    vector<int> sampleX, sampleY;
+    vector<double> previous;    //scaled samples of the last check, empty before the first one
+    double delta = -1;          //shape delta of the last check
+    const char* stopReason = 0; //"converged" or "deadline" once the walk was ended early
+    FrameRecorder* recorder = 0; //--timelapse frames, 0 when off
+};
+
+const int MONITOR_SAMPLES = 128;
+
+//Struct WalkOptions groups the settings that change how makeParticleMap walks the particles
+struct WalkOptions
+{
+    GridLayout layout = LAYOUT_ROWS;
+    int walkers = 0;             //particles walked in lockstep by walkLockstep (8 or 16), 0 walks them one at a time
+    bool orderedWalkers = false; //re-pick stale lanes so lockstep matches a round-robin serial walk exactly
+    Neighborhood neighborhood = NEIGHBORHOOD_MOORE;
+    WalkMonitor* monitor = 0;    //checks the map every few particles, 0 walks every particle
+    const vector<unsigned int>* dropCells = 0; //row-major cells to drop on uniformly instead of the disk (--refine)
+};
+
+//Struct PreviewOptions groups the settings of --preview: walk a grid shrunk by factor, scale it back up, and
+//optionally walk the coast band again at full resolution and run the full walk to compare against
+struct PreviewOptions
+{
+    int factor = 0;              //0 when --preview is off
+    bool refine = false;
+    bool compare = false;
+};
+const int COAST_BAND = 16;       //normalized levels either side of the waterline that --refine walks again
+
+//Struct PreviewReport is what the preview did, for the console line and the --compare scores
+struct PreviewReport
+{
+    int width = 0, height = 0, radius = 0, particles = 0, maxLife = 0; //the shrunk walk
+    double previewSeconds = 0, refineSeconds = 0;
+    long long bandCells = 0, refineParticles = 0;
+};
+
+//Struct PickTables holds the lookups the lockstep walker uses to turn valid-direction bits and a random number
+//into a direction: the number of valid directions and the k-th valid direction (-1 for a dead end)
+struct PickTables
+{
+    int popcount[256];
+    int direction[256 * 8];
+    PickTables()
+    {
+        for(int moves = 0; moves < 256; moves++)
+        {
+            popcount[moves] = 0;
+            for(int k = 0; k < 8; k++)
+                direction[moves * 8 + k] = -1;
+            for(int bit = 0; bit < 8; bit++)
+            {
+                if(moves & (1 << bit))
+                    direction[moves * 8 + popcount[moves]++] = bit;
+            }
+        }
+    }
+};
+const PickTables PICK;
+const int MAX_WALKERS = 16;
+
+//Enum SmoothKernel picks the blur applied to the raw particle counts before they are normalized
+enum SmoothKernel { SMOOTH_NONE, SMOOTH_BOX, SMOOTH_GAUSS };
+
+//Struct SmoothOptions groups the settings of the optional smoothing stage between makeParticleMap and normalizeMap
+struct SmoothOptions
+{
+    SmoothKernel kernel = SMOOTH_NONE;
+    int radius = 1;              //blur taps on each side of a cell (1 - 15)
+    int erodeIterations = 0;     //thermal erosion passes run after the blur
+};
+const int MAX_SMOOTH_RADIUS = 15;
+const int SMOOTH_BLOCK = 1024;   //columns per block of the vertical blur, so the tap rows stay in L1
+
+//Terrain schemes used by generateIsland, selected with --terrain
+//Values below deep * waterLine are deep water and the rest up to the waterline shallow water. The land above is split
+//at the beach, grass and forest fractions of (255 - waterLine) into beach, grass, forest and mountains
+enum TerrainScheme { TERRAIN_CLASSIC, TERRAIN_HIGHLANDS, TERRAIN_LOWLANDS };
+
+//Struct ClassicTerrain is the original split
+struct ClassicTerrain
+{
+    static constexpr double deep = 0.5, beach = 0.15, grass = 0.4, forest = 0.8;
+    static constexpr const char* name = "classic";
+};
+
+//Struct HighlandsTerrain has narrow beaches and most of the land as forest and mountains
+struct HighlandsTerrain
+{
+    static constexpr double deep = 0.5, beach = 0.08, grass = 0.25, forest = 0.55;
+    static constexpr const char* name = "highlands";
+};
+
+//Struct LowlandsTerrain has wide beaches and grassland with only the highest peaks as mountains
+struct LowlandsTerrain
+{
+    static constexpr double deep = 0.4, beach = 0.25, grass = 0.65, forest = 0.92;
+    static constexpr const char* name = "lowlands";
+};
+
+//Struct TerrainClass is one band of a terrain palette
+//Water classes split [0, waterLine] at threshold * waterLine and land classes split (waterLine, 255] at
+//waterLine + threshold * (255 - waterLine); the last class of each zone takes the rest of its zone
+struct TerrainClass
+{
+    bool water;
+    double threshold;
+    char glyph;
+    std::string foreground, background; //termcolor color names (blue, bright_green, ...) or #rrggbb
+};
+
+//Struct TerrainPalette is the ordered list of terrain classes of a run, loaded from --palette or built from --terrain
+//compilePalette fills in the per-glyph tables used while classifying, printing and analyzing the island
+struct TerrainPalette
+{
+    vector<TerrainClass> classes;
+    bool water[256];          //by glyph: the glyph is a water class
+    char beach;               //glyph of the first land class, which --coast-distance counts as shoreline
+    std::string cells[256];   //by glyph: the colored console cell, escape sequences and all
+    unsigned char rgb[256][3]; //by glyph: the background color as RGB, for --image
+    unsigned int hash;        //FNV-1a of the classification (not the colors), part of the cache key
+};
+
+//Struct ConsoleView is the part of the maps --view shows on the console; island.txt always gets every cell
+//A window of cells is shown one character (or grid value) per factor x factor block: the highest value of a block
+//for grids and its most common glyph for the island. fit shows the whole map, pooled just enough to fit the terminal
+struct ConsoleView
+{
+    bool enabled = false;
+    bool fit = false;
+    int x = 0, y = 0, width = 0, height = 0;
+    int factor = 1;
+    int columns = 80, rows = 24;    //terminal size, for fit
+};
+
+//Struct ViewWindow is a ConsoleView resolved against one map: the cells it covers and the pooled size
+struct ViewWindow
+{
+    int x, y, endX, endY;
+    int factor;
+    int columns, rows;
+};
+
+//Struct GridPool max-pools the rows of a grid into the rows of its --view window, one map row at a time
+struct GridPool
+{
+    ViewWindow window;
+    vector<int> pooled;
+    void start(const ViewWindow& viewWindow);
+    template<class Cell>
+    bool addRow(int row, const Cell* values, std::string& line);
+};
+
+//Struct GlyphPool pools island rows into the rows of its --view window: the most common glyph of every block
+struct GlyphPool
+{
+    ViewWindow window;
+    const TerrainPalette* palette;
+    bool colored;
+    vector<unsigned int> counts;
+    vector<unsigned char> mode;
+    vector<unsigned int> modeCount;
+    void start(const ViewWindow& viewWindow, const TerrainPalette& terrainPalette, bool coloredCells);
+    bool addRow(int row, const char* glyphs, std::string& line);
+};
+
+//Struct ShardResult is what a --shards worker process reports back through the shared segment next to its grid
+struct ShardResult
+{
+    int done;                    //set last, once the grid and the counters are complete
+    long long particles, steps, deadEndKills;
+    double seconds;              //the shard's own walk, without forking and waiting
+    const char* layout;          //the same binary runs in both processes after fork, so these names stay valid
+    const char* neighborhood;
+};
+const int SHARD_ATTEMPTS = 3;    //times a shard is started before the run gives up on it
+
+//Struct BandText is the text formatRows has a band of rows format: the console-only, file-only and shared text
+//Each destination must get all of a printer's text from one of them, or its rows would come out of order
+struct BandText
+{
+    std::string console, file, both;
+};
+
+//Destinations of OutputWriter::append, combined as bits
+enum OutputTarget { OUTPUT_CONSOLE = 1, OUTPUT_FILE = 2, OUTPUT_BOTH = 3 };
+
+//Struct OutputWriter hands the console and island.txt output to a writer thread in completed chunks
+//The generating thread fills one buffer per destination. A full buffer is swapped into a small ring of slots that the
+//writer thread drains in order, and the slot's already written buffer comes back to be filled next, so each
+//destination is double buffered without allocating. When every slot is still waiting on a slow disk or terminal,
+//submit blocks until one is written, which keeps generation from running arbitrarily far ahead
+struct OutputWriter
+{
+    static const int SLOTS = 4;
+    static const size_t CHUNK = 1 << 20;  //bytes collected before a buffer is handed to the writer
+    struct Slot
+    {
+        int target;
+        std::string data;
+    };
+    FILE* file;
+    std::string pending[2];     //buffers being filled for the console and the file
+    Slot slots[SLOTS];
+    int head = 0, count = 0;    //oldest queued slot and number of queued slots, guarded by lock
+    bool closing = false;
+    std::mutex lock;
+    std::condition_variable queued, written;
+    std::thread worker;
+    ConsoleView view;           //what the map printers show on the console
+    bool muted = false;         //no file and no console: the map printers skip their text (libislandgen)
+    int threads = 1;            //threads the map printers format rows on
+    unsigned long long formatBytes = 0; //text the map printers formatted, and the time it took
+    double formatSeconds = 0;
+
+    OutputWriter(const char* fileName);
+    ~OutputWriter();
+    void append(int targets, const char* text, size_t length);
+    void print(int targets, const char* format, ...);
+    void submit(int target);
+    void drain();
+    void close();
+    void run();
+};
+
+//Counters --counters reads around each stage: five hardware events, and the task clock (CPU time) as the software
+//event that is there even when the hardware ones are not permitted or don't exist, as in most virtual machines
+enum PerfCounter { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_LLC_MISSES, PERF_BRANCH_MISSES, PERF_DTLB_MISSES, PERF_TASK_CLOCK, PERF_COUNTERS };
+
+//Stages of main's pipeline that --counters reports on
+enum CountedStage { STAGE_WALK, STAGE_SMOOTH, STAGE_NORMALIZE, STAGE_ISLAND, STAGE_FUSED, STAGE_ANALYZE, STAGE_DISTANCE, COUNTED_STAGES };
+
+//Struct PerfCounters is the open perf_event file descriptors of --counters, -1 for the ones that could not be opened
+struct PerfCounters
+{
+    int fd[PERF_COUNTERS];
+    PerfCounters() { std::fill(fd, fd + PERF_COUNTERS, -1); }
+};
+
+//Struct StageCounters is what --counters counted in each stage, for printStats
+struct StageCounters
+{
+    bool on = false;             //--counters was given
+    int error = 0;               //errno of the first counter that could not be opened
+    bool open[PERF_COUNTERS] = {};
+    bool ran[COUNTED_STAGES] = {};
+    long long counts[COUNTED_STAGES][PERF_COUNTERS] = {};
+};
+
+//Struct RunStats collects the counters and stage timings reported with --stats
+struct RunStats
+{
+    long long particles = 0;      //particles dropped
+    long long particlesAsked = 0; //particles requested, more than dropped when the walk stopped early
+    const char* stopReason = 0;   //why the walk stopped early: "converged" or "deadline"
+    double shapeDelta = -1;       //last --converge shape delta
+    long long timelapseFrames = 0;  //--timelapse frames written
+    unsigned long long timelapseBytes = 0;
+    double timelapseSeconds = 0;    //part of the walk spent recording frames
+    double savedSeconds = 0;      //estimated walk time the early stop saved
+    long long steps = 0;          //valid moves made by all particles
+    long long deadEndKills = 0;   //particles killed on a dead end before their life ran out
+    long long deadEndCells = 0;   //dead-end cells when the simulation finished, -1 when no full-size walk found them
+    vector<unsigned long long> deadEnds; //final dead-end bitmap, written out as island_deadends.pbm
+    const char* layout = "rows";  //memory layout the walk ran on
+    const char* neighborhood = "moore"; //directions a particle could move in
+    int walkers = 0;              //lockstep lanes, 0 for the one-at-a-time walk
+    bool orderedWalkers = false;
+    int shards = 0;               //--shards worker processes, 0 when the walk ran in this process
+    int shardRetries = 0;         //shard processes that failed and were started again
+    double mergeSeconds = 0;      //summing the shard grids
+    double fastestShard = 0, slowestShard = 0; //walk times of the quickest and the slowest shard
+    StageCounters counters;       //--counters events per stage
+    const char* cache = 0;        //"hit" or "stored" when --cache-dir is in use
+    int threads = 1;              //worker threads for the parallel stages
+    double analyzeSeconds = -1;   //connected-component labeling, when --analyze ran
+    double distanceSeconds = -1;  //distance-to-coast transform, when --coast-distance ran
+    double smoothSeconds = -1;    //blur and erosion of the raw counts, when --smooth or --erode ran
+    double fusedSeconds = -1;     //normalize, classify and print in one pass, when --fused ran
+    unsigned long long formatBytes = 0; //text the map printers formatted, and the time it took
+    double formatSeconds = 0;
+    double simulateSeconds = 0;   //time spent walking particles (excludes printing the raw grid)
+    double particleMapSeconds = 0, normalizeSeconds = 0, islandSeconds = 0;
+};
+
+//Bump GENERATOR_VERSION whenever a change alters the islands produced for the same parameters, so cached results
+//made by older builds stop matching (and update the --check golden hashes in CHECK_CASES with it)
+const unsigned int GENERATOR_VERSION = 1;
+
+//Struct CheckCase is one run of the --check matrix: its inputs and the FNV-1a hashes its planes must come out with
+//The raw plane is hashed as int32 counts, the normalized plane as one byte per cell and the terrain as its glyphs
+struct CheckCase
+{
+    const char* name;
+    int width, height, windowX, windowY, radius, particles, maxLife, waterLine;
+    unsigned int seed;
+    GridLayout layout;
+    Neighborhood neighborhood;
+    int walkers;
+    bool orderedWalkers;
+    TerrainScheme terrain;
+    SmoothKernel kernel;
+    int erodeIterations;
+    double landFraction;         //-1 keeps waterLine
+    unsigned long long raw, normalized, terrainHash;
+};
+const CheckCase CHECK_CASES[] =
+{
+    {"classic", 120, 60, 60, 30, 25, 20000, 60, 90, 9, LAYOUT_ROWS, NEIGHBORHOOD_MOORE, 0, false, TERRAIN_CLASSIC,
+     SMOOTH_NONE, 0, -1,
+     0xf691070aeea6c2e0ULL, 0x45863c6b9c93573bULL, 0x5582cdd7efadef23ULL},
+    {"classic tile16", 120, 60, 60, 30, 25, 20000, 60, 90, 9, LAYOUT_TILE16, NEIGHBORHOOD_MOORE, 0, false, TERRAIN_CLASSIC,
+     SMOOTH_NONE, 0, -1,
+     0xf691070aeea6c2e0ULL, 0x45863c6b9c93573bULL, 0x5582cdd7efadef23ULL},
+    {"morton hex", 256, 256, 128, 128, 100, 60000, 200, 120, 42, LAYOUT_MORTON, NEIGHBORHOOD_HEX, 0, false, TERRAIN_CLASSIC,
+     SMOOTH_NONE, 0, -1,
+     0x670c993dd99e45a3ULL, 0x4ae85fa1476b37fcULL, 0x96c1bdcb509c6a2fULL},
+    {"vonneumann 16 walkers", 300, 200, 150, 100, 80, 60000, 150, 60, 7, LAYOUT_ROWS, NEIGHBORHOOD_VON_NEUMANN, 16, false,
+     TERRAIN_LOWLANDS, SMOOTH_NONE, 0, -1,
+     0x37b03a870b0d8891ULL, 0x3c608eb2a4183565ULL, 0xf1008b178007c968ULL},
+    {"ordered 8 walkers", 200, 200, 100, 100, 90, 50000, 300, 100, 3, LAYOUT_TILE8, NEIGHBORHOOD_MOORE, 8, true,
+     TERRAIN_HIGHLANDS, SMOOTH_NONE, 0, -1,
+     0x1702d5ddc0aaa104ULL, 0xec4da9fe909e0e74ULL, 0xb68a35c688b56901ULL},
+    {"gauss erode", 256, 128, 100, 70, 60, 40000, 400, 80, 11, LAYOUT_ROWS, NEIGHBORHOOD_MOORE, 0, false, TERRAIN_CLASSIC,
+     SMOOTH_GAUSS, 3, -1,
+     0x68aedfa24e5c709bULL, 0x4789745f1a852e04ULL, 0x1055b1adf64ca9b6ULL},
+    {"land fraction", 400, 300, 200, 150, 140, 80000, 500, 0, 5, LAYOUT_ROWS, NEIGHBORHOOD_MOORE, 8, false, TERRAIN_CLASSIC,
+     SMOOTH_BOX, 0, 0.35,
+     0x57fb83a77e26365aULL, 0xab537c8005d3d5d2ULL, 0x0be40498db753f8cULL},
+};
+const int CHECK_RUNS = 5;        //timed samples per case, after a warmup one; the median counts
+const double CHECK_SAMPLE_SECONDS = 0.1; //a sample walks its case as many times as it takes to run this long
+
+//Struct CacheParams is every input that decides the raw, normalized and terrain maps, hashed into the cache key
+//Walk settings that do not change the result (the layout) are left out
+struct CacheParams
+{
+    int width, height, windowX, windowY, radius, particles, maxLife, waterLine;
+    unsigned int seed;
+    int walkers, orderedWalkers;
+    int smoothKernel, smoothRadius, erodeIterations;
+    int landFractionPpm;         //--land-fraction in parts per million, 0 when the waterline was entered
+    long long convergeEvery;     //--converge-every, 0 when --converge is off
+    int convergePpm;             //--converge tolerance in millionths
+    int neighborhood;
+    int shards;                  //--shards, 0 for the single-process walk
+    unsigned int paletteHash;
+    unsigned int version;
+};
+
+//Struct CacheHeader starts every cache entry; the three planes follow at the given offsets
+//raw counts are int32, the normalized map one byte per cell and the terrain one glyph per cell, all row-major
+struct CacheHeader
+{
+    char magic[8];                  //"ISLCACHE"
+    CacheParams params;             //checked against the request so a hash collision is never served
+    unsigned long long rawOffset, normalizedOffset, terrainOffset, fileSize;
+    long long steps, deadEndKills, deadEndCells; //simulation counters for --stats
+    long long particles;            //particles actually dropped, fewer than asked when --converge stopped the walk
+};
+
+//Struct CacheEntry is a cache file mapped read-only, with row pointers into each plane
+struct CacheEntry
+{
+    void* data = 0;
+    size_t size = 0;
+    vector<int*> raw;
+    vector<unsigned char*> normalized;
+    vector<char*> terrain;
+};
+
+//Struct Component is one connected land mass or body of water found by labelComponents
+//Land connects through all eight neighbors and water only through the four edge neighbors, so a diagonal strip of
+//land splits the water on either side of it
+struct Component
+{
+    bool land;                 //land classes of the palette ('.', '-', '*' or '^' by default); otherwise water
+    bool touchesEdge;          //water touching the map edge is open sea, water that does not is a lake
+    long long area;            //cells
+    int minX, minY, maxX, maxY;
+    double sumX, sumY;         //coordinate sums, centroid = sum / area
+};
+
+//Struct RangeEncoder is an adaptive binary range coder writing into a byte buffer
+//Probabilities are 11-bit counts of a 0 bit that move 1/32 of the way towards each coded bit
+struct RangeEncoder
+{
+    unsigned long long low = 0;
+    unsigned int range = 0xFFFFFFFF;
+    unsigned char cache = 0;
+    unsigned long long cacheSize = 1;
+    vector<unsigned char> bytes;
+    void encode(unsigned short& probability, int bit);
+    void shiftLow();
+    void finish();
+};
+
+//Struct RangeDecoder reads back what RangeEncoder wrote; reading past the end yields zero bytes
+struct RangeDecoder
+{
+    const unsigned char* next;
+    const unsigned char* end;
+    unsigned int range = 0xFFFFFFFF, code = 0;
+    RangeDecoder(const unsigned char* data, size_t size);
+    int decode(unsigned short& probability);
+    unsigned char nextByte() { return next < end ? *next++ : 0; }
+};
+
+//Struct MapModel holds the adaptive probabilities of the --compress format, one copy for encoding and one for decoding
+//The normalized plane codes the residual from a median edge predictor (left, up, up-left) in an 8-bit tree chosen by
+//the size of the previous residual. The terrain plane codes each row as runs: the glyph in a tree chosen by the
+//previous run's glyph, then the length as an Elias-gamma number with adaptive prefix and mantissa bits
+struct MapModel
+{
+    vector<unsigned short> residual, glyph, lengthPrefix, lengthBits;
+    MapModel() : residual(3 * 256, 1024), glyph(256 * 256, 1024), lengthPrefix(32, 1024), lengthBits(33 * 32, 1024) {}
+};
+
+//Struct MapArchive collects the compressed planes while normalizeMap and generateIsland produce them row by row
+struct MapArchive
+{
+    int width = 0, height = 0;
+    MapModel model;
+    RangeEncoder normalized, terrain;
+    vector<int> previous;       //the normalized row above the one being coded
+    int normalizedRows = 0, terrainRows = 0;
+    unsigned char rowStart = 0; //first glyph of the terrain row above, the context of the next row's first run
+    double seconds = 0;         //time spent encoding
+};
+
+//Struct ArchiveHeader starts a --compress file, followed by the normalized and the terrain sections
+struct ArchiveHeader
+{
+    char magic[4];              //"ISLZ"
+    unsigned int version;
+    int width, height;
+    unsigned long long normalizedBytes, terrainBytes;
+};
+
+//Struct PyramidLevel is one level of a --pyramid file, half the size of the level below it (rounded up)
+//Level 0 is the full map and keeps a single height plane, its max and mean are the normalized values themselves
+struct PyramidLevel
+{
+    int width, height;
+    vector<unsigned char> maxHeight, meanHeight, terrain;
+};
+
+//Struct MapPyramid collects the levels of a --pyramid file while the maps are produced
+struct MapPyramid
+{
+    vector<PyramidLevel> levels;
+    double seconds = 0;         //time spent reducing the levels above 0
+};
+
+//Struct PyramidHeader starts a --pyramid file. levels PyramidEntry records follow it, then the planes, each starting
+//on a 4096-byte boundary so a viewer can mmap just the plane it shows
+struct PyramidHeader
+{
+    char magic[4];              //"ISLP"
+    unsigned int version;
+    int width, height;
+    int levels;
+    int reserved;
+};
+
+//Struct PyramidEntry locates the planes of one level in a --pyramid file (offsets from the start of the file)
+struct PyramidEntry
+{
+    int width, height;
+    unsigned long long maxOffset, meanOffset, terrainOffset;
+};
+
+const int DROP_BATCH_SIZE = 4096;          //drop positions are drawn ahead of the walk in batches of this size
+const long long ALIAS_CELL_LIMIT = 1 << 25; //clipped disks with a larger bounding box fall back to polar rejection
+
 float frand();
-int** makeParticleMap(int** map, int width, int height, int windowX, int windowY, int radius, int numParticles, int maxLife, ofstream& outFile);
+bool buildDropSampler(DropSampler& sampler, int width, int height, int windowX, int windowY, int radius);
+bool dropZoneOnGrid(int width, int height, int windowX, int windowY, int radius);
+void uniformDropSampler(DropSampler& sampler, const vector<unsigned int>& cells);
+double dropCellArea(double x0, double x1, double y0, double y1, int windowX, int windowY, int radius);
+void fillDropBatch(DropSampler& sampler, int width, int height, int windowX, int windowY, int radius, int* dropX, int* dropY, int count);
+int** makeParticleMap(int** map, int width, int height, int windowX, int windowY, int radius, int numParticles, int maxLife, const WalkOptions& walk, OutputWriter& output, RunStats& stats);
+bool shardParticleMap(int** map, int width, int height, int windowX, int windowY, int radius, int numParticles, int maxLife, const WalkOptions& walk, unsigned int seed, int shards, int threads, OutputWriter& output, RunStats& stats);
+void previewParticleMap(int** map, int width, int height, int windowX, int windowY, int radius, int numParticles, int maxLife, int waterLine, double landFraction, const WalkOptions& walk, const PreviewOptions& preview, PreviewReport& report, OutputWriter& output, RunStats& stats);
+void comparePreview(int** normalized, char** terrain, int width, int height, int windowX, int windowY, int radius, int numParticles, int maxLife, int waterLine, double landFraction, const WalkOptions& walk, const SmoothOptions& smooth, const TerrainPalette& palette, unsigned int seed, int threads, const PreviewReport& report, OutputWriter& output);
+void addPlane(int* __restrict out, const int* __restrict in, int width);
+void openCounters(PerfCounters& perf, StageCounters& counters);
+void readCounters(const PerfCounters& perf, long long values[PERF_COUNTERS]);
+void countStage(const PerfCounters& perf, const long long before[PERF_COUNTERS], StageCounters& counters, CountedStage stage);
+void closeCounters(PerfCounters& perf);
+void printCounters(const StageCounters& counters);
+bool runCheck(const char* baselineFile, double tolerance, bool perfGate, int threads);
+unsigned long long hashBytes(const void* data, size_t length, unsigned long long hash);
+template<class Layout, class Hood>
+void runWalk(int** map, int width, int height, DropSampler& sampler, int windowX, int windowY, int radius, int numParticles, int maxLife, const WalkOptions& walk, RunStats& stats);
+template<class Layout, class Hood>
+void walkParticles(const Layout& grid, int** map, int width, int height, DropSampler& sampler, int windowX, int windowY, int radius, int numParticles, int maxLife, const WalkOptions& walk, RunStats& stats);
+template<class Layout, class Hood>
+void walkLockstep(const Layout& grid, int* counts, unsigned char* valid, int width, int height, DropSampler& sampler, int windowX, int windowY, int radius, int numParticles, int maxLife, const WalkOptions& walk, RunStats& stats);
+void startMonitor(WalkMonitor& monitor, int width, int height, long long particles);
+bool startTimelapse(FrameRecorder& recorder, const char* fileName, int width, int height, int layout, long long particles);
+template<class Layout>
+void beginFrames(FrameRecorder& recorder, const Layout& grid);
+void recordFrame(FrameRecorder& recorder, long long particles, const int* counts);
+template<class Layout>
+void layoutOrder(int width, int height, vector<long long>& order);
+unsigned char* writeVarint(unsigned char* out, unsigned long long value);
+unsigned long long readVarint(const unsigned char*& next, const unsigned char* end);
+void finishTimelapse(FrameRecorder& recorder);
+bool replayTimelapse(const char* fileName, long long frame, OutputWriter& output);
+template<class Layout>
+bool checkWalk(WalkMonitor& monitor, const Layout& grid, const int* counts);
+unsigned int walkerRandom(unsigned int state);
+int pickDirection(unsigned int moves, unsigned int random);
+void stepLanes(const unsigned char* valid, const int* cell, unsigned int* state, int* direction, int lanes);
+#ifdef ISLAND_AVX2_KERNEL
+void stepLanesAvx2(const unsigned char* valid, const int* cell, unsigned int* state, int* direction, int lanes);
+#endif
+template<class Hood>
+unsigned char validMoves(int** map, int width, int height, int x, int y);
+template<class Layout, class Hood>
+void updateMoveMap(const Layout& grid, const int* counts, unsigned char* valid, int width, int height, int x, int y);
+void writeDeadEndMap(const vector<unsigned long long>& bits, int width, int height, const char* fileName);
+void printStats(const RunStats& stats, int width, int height);
+double secondsSince(std::chrono::steady_clock::time_point start);
+void appendCell(std::string& line, int value);
 bool moveExists(int** map, int width, int height, int x, int y, int newX, int newY);
 int findMax(int** map, int width, int height);
-int** normalizeMap(int** norMap, int width, int height, ofstream& outFile);
-void generateIsland(int** map, int width, int height, int waterLine, ofstream& outFile);
-void printGrid(int** map, int width, int height, ofstream& outFile);
+int** normalizeMap(int** norMap, int width, int height, int threads, long long histogram[256], MapArchive* archive, MapPyramid* pyramid, OutputWriter& output);
+int chooseWaterLine(const long long histogram[256], long long cells, double landFraction);
+void smoothMap(int** map, int width, int height, const SmoothOptions& smooth, int threads);
+int erodeCell(int here, int left, int right, int up, int down, int talus);
+char** generateIsland(int** map, int width, int height, int waterLine, const TerrainPalette& palette, MapArchive* archive, MapPyramid* pyramid, OutputWriter& output);
+void classifyTerrain(const TerrainPalette& palette, int** map, char** island, int width, int height, int waterLine);
+void glyphTable(const TerrainPalette& palette, int waterLine, char glyphs[256]);
+bool fusedPipeline(int** map, int width, int height, int waterLine, const TerrainPalette& palette, int threads, MapPyramid* pyramid, FILE* image, OutputWriter& output);
+bool writeAt(int fd, const void* data, size_t bytes, long long offset);
+bool startImage(const char* fileName, int width, int height, FILE*& image);
+void imageRow(const TerrainPalette& palette, const char* glyphs, int width, unsigned char* rgb);
+void writeImage(char** island, int width, int height, const TerrainPalette& palette, FILE* image);
+template<class Scheme>
+void schemePalette(TerrainPalette& palette);
+bool loadPalette(const char* fileName, TerrainPalette& palette);
+bool renderColor(const std::string& name, bool background, std::string& escape, unsigned char* rgb);
+void compilePalette(TerrainPalette& palette);
+void printIsland(char** island, int width, int height, const TerrainPalette& palette, OutputWriter& output);
+void printIslandView(char** island, int width, int height, const TerrainPalette& palette, OutputWriter& output);
+bool beginView(OutputWriter& output, int width, int height, int cellWidth, ViewWindow& window);
+bool resolveView(const ConsoleView& view, int width, int height, int cellWidth, ViewWindow& window);
+void announceView(OutputWriter& output, int width, int height, const ViewWindow& window, bool viewed);
+bool parseView(const char* text, ConsoleView& view);
+template<class Cell>
+void printGrid(Cell** map, int width, int height, OutputWriter& output);
+std::string cacheEntryPath(const char* cacheDir, const CacheParams& params);
+bool openCacheEntry(const char* cacheDir, const CacheParams& params, CacheEntry& entry);
+void closeCacheEntry(CacheEntry& entry);
+bool storeCacheEntry(const char* cacheDir, const CacheParams& params, const int* raw, int** normalized, char** island, const RunStats& stats);
+void evictCache(const char* cacheDir, long long maxBytes);
+bool loadHeightmap(const char* fileName, int** map, int width, int height, int target, int threads);
+template<class Work>
+void parallelBands(int height, int threads, Work work);
+template<class Format, class Serial>
+void formatRows(int height, size_t rowBytes, OutputWriter& output, Format format, Serial serial);
+void labelComponents(char** island, int width, int height, const TerrainPalette& palette, int threads, vector<unsigned int>& labels, vector<Component>& components);
+unsigned int findRoot(unsigned int* parent, unsigned int cell);
+unsigned int linkRoots(unsigned int* parent, unsigned int root, unsigned int cell, unsigned int neighbor);
+void uniteCells(unsigned int* parent, unsigned int a, unsigned int b, vector<unsigned int>* reparented);
+void reportComponents(const vector<Component>& components, const char* fileName);
+bool isCoast(char** island, int width, int height, const TerrainPalette& palette, int x, int y);
+void distanceToCoast(char** island, int width, int height, const TerrainPalette& palette, int threads, vector<unsigned short>& distances);
+void writeDistancePlane(const vector<unsigned short>& distances, int width, int height, const char* fileName);
+template<class Cell>
+void encodeNormalizedRow(MapArchive& archive, const Cell* row);
+void encodeTerrainRow(MapArchive& archive, const char* row);
+void decodeNormalizedRow(RangeDecoder& decoder, MapModel& model, const int* above, int* row, int width);
+void decodeTerrainRow(RangeDecoder& decoder, MapModel& model, unsigned char& rowStart, char* row, int width);
+int medianPrediction(int left, int up, int upLeft);
+void encodeTree(RangeEncoder& encoder, unsigned short* probabilities, int value);
+int decodeTree(RangeDecoder& decoder, unsigned short* probabilities);
+void encodeRunLength(RangeEncoder& encoder, MapModel& model, unsigned int length);
+unsigned int decodeRunLength(RangeDecoder& decoder, MapModel& model);
+bool writeArchive(MapArchive& archive, const char* fileName);
+void startPyramid(MapPyramid& pyramid, int width, int height);
+void reducePyramid(MapPyramid& pyramid, int threads);
+unsigned char modeOfBlock(const unsigned char* glyphs, int count);
+bool writePyramid(const MapPyramid& pyramid, const char* fileName);
+bool decodeArchive(const char* fileName, const TerrainPalette& palette, OutputWriter& output);
 
+#ifndef ISLANDGEN_LIBRARY
 int main(int argc, char** argv)
 {
     //Command line argument checks and seeding srand
-    if(argc == 1)
-        srand(time(0)); //srand is seeded with time(0) if [-s integer] is not selected
-    else if (argc == 3 && strcmp(argv[1], "-s") == 0) 
-        srand(atoi(argv[2])); //Seeds a number if [-s integer] is selected
+    //srand is seeded with time(0) unless [-s integer] is selected, --stats prints counters and timings at the end
+    //--counters adds the hardware performance counters of each stage to them
+    //--check runs the fixed CHECK_CASES matrix against its golden hashes and the throughput stored in --baseline
+    //--layout picks the memory layout of the grid during the particle walk (rows, tile8, tile16 or morton)
+    //--walkers walks 8 or 16 particles in lockstep, --ordered-walkers keeps them in round-robin serial order
+    //--cache-dir reuses results stored under a hash of all parameters, evicting the least recently used entries
+    //once the directory grows past --cache-size megabytes (1024 by default)
+    //--analyze labels the land masses and lakes of the finished island, --threads sets the worker threads
+    //--coast-distance writes every cell's Euclidean distance to the shoreline to island_coast.pgm
+    //--smooth blurs the raw particle counts (box or gauss over --smooth-radius cells), --erode runs thermal erosion passes
+    //--neighborhood picks the directions a particle can move in (moore, vonneumann or hex), --terrain the terrain scheme
+    //--palette loads the terrain classes and their colors from a file instead
+    //--converge ends the walk once the map stops changing, --deadline once it has run too long
+    //--timelapse records the raw counts every few particles, --replay prints one of those frames back
+    //--image writes the island as a color picture
+    //--fused normalizes, classifies and writes out the map in one pass, without building the terrain map
+    //--pyramid writes the maps at every power-of-two zoom level for a map viewer
+    //--view shows only a window or a pooled overview of the maps on the console
+    //--compress also stores the normalized and terrain maps compressed in a file, --decode prints such a file back
+    //--preview walks a grid k times smaller and scales it up, --refine walks the coast band again at full size and
+    //--compare also runs the full walk and scores how close the preview came
+    //--shards splits the particles over that many worker processes, each walking its own grid, and sums the grids
+    //--heightmap starts the walk on the heights in a file instead of an empty grid, scaled to --heightmap-max when set
+    //--land-fraction picks the waterline that leaves that fraction of the cells as land instead of asking for one
+    unsigned int seed = time(0);
+    bool showStats = false;
+    bool analyze = false;
+    bool coastDistance = false;
+    SmoothOptions smooth;
+    double landFraction = -1;
+    TerrainScheme terrainScheme = TERRAIN_CLASSIC;
+    const char* paletteFile = 0;
+    const char* archiveFile = 0;
+    const char* decodeFile = 0;
+    const char* pyramidFile = 0;
+    const char* imageFile = 0;
+    bool fused = false;
+    ConsoleView view;
+    WalkMonitor monitor;
+    FrameRecorder recorder;
+    const char* timelapseFile = 0;
+    const char* replayFile = 0;
+    long long replayFrame = 0;
+    int threads = std::thread::hardware_concurrency() > 0 ? std::thread::hardware_concurrency() : 1;
+    int shards = 0;
+    bool countEvents = false;
+    PreviewOptions preview;
+    const char* heightmapFile = 0;
+    int heightmapMax = 0;
+    bool check = false;
+    bool perfGate = true;
+    const char* baselineFile = "island_check_baseline.txt";
+    double tolerance = 30;           //percent: repeated --check runs on one machine drift by 25% and more
+    WalkOptions walk;
+    const char* cacheDir = 0;
+    long long cacheMegabytes = 1024;
+    for(int arg = 1; arg < argc; arg++)
+    {
+        bool valid = true;
+        if(strcmp(argv[arg], "-s") == 0 && arg + 1 < argc)
+            seed = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--stats") == 0)
+            showStats = true;
+        else if(strcmp(argv[arg], "--counters") == 0)
+            showStats = countEvents = true;
+        else if(strcmp(argv[arg], "--check") == 0)
+            check = true;
+        else if(strcmp(argv[arg], "--no-perf-gate") == 0)
+            perfGate = false;
+        else if(strcmp(argv[arg], "--baseline") == 0 && arg + 1 < argc)
+            baselineFile = argv[++arg];
+        else if(strcmp(argv[arg], "--tolerance") == 0 && arg + 1 < argc)
+        {
+            tolerance = atof(argv[++arg]);
+            valid = tolerance > 0;
+        }
+        else if(strcmp(argv[arg], "--layout") == 0 && arg + 1 < argc)
+        {
+            arg++;
+            if(strcmp(argv[arg], "rows") == 0)
+                walk.layout = LAYOUT_ROWS;
+            else if(strcmp(argv[arg], "tile8") == 0)
+                walk.layout = LAYOUT_TILE8;
+            else if(strcmp(argv[arg], "tile16") == 0)
+                walk.layout = LAYOUT_TILE16;
+            else if(strcmp(argv[arg], "morton") == 0)
+                walk.layout = LAYOUT_MORTON;
+            else
+                valid = false;
+        }
+        else if(strcmp(argv[arg], "--neighborhood") == 0 && arg + 1 < argc)
+        {
+            arg++;
+            if(strcmp(argv[arg], Moore8::name) == 0)
+                walk.neighborhood = NEIGHBORHOOD_MOORE;
+            else if(strcmp(argv[arg], VonNeumann4::name) == 0)
+                walk.neighborhood = NEIGHBORHOOD_VON_NEUMANN;
+            else if(strcmp(argv[arg], Hex6::name) == 0)
+                walk.neighborhood = NEIGHBORHOOD_HEX;
+            else
+                valid = false;
+        }
+        else if(strcmp(argv[arg], "--terrain") == 0 && arg + 1 < argc)
+        {
+            arg++;
+            if(strcmp(argv[arg], ClassicTerrain::name) == 0)
+                terrainScheme = TERRAIN_CLASSIC;
+            else if(strcmp(argv[arg], HighlandsTerrain::name) == 0)
+                terrainScheme = TERRAIN_HIGHLANDS;
+            else if(strcmp(argv[arg], LowlandsTerrain::name) == 0)
+                terrainScheme = TERRAIN_LOWLANDS;
+            else
+                valid = false;
+        }
+        else if(strcmp(argv[arg], "--palette") == 0 && arg + 1 < argc)
+            paletteFile = argv[++arg];
+        else if(strcmp(argv[arg], "--compress") == 0 && arg + 1 < argc)
+            archiveFile = argv[++arg];
+        else if(strcmp(argv[arg], "--decode") == 0 && arg + 1 < argc)
+            decodeFile = argv[++arg];
+        else if(strcmp(argv[arg], "--converge") == 0 && arg + 1 < argc)
+        {
+            monitor.tolerance = atof(argv[++arg]);
+            valid = monitor.tolerance > 0;
+        }
+        else if(strcmp(argv[arg], "--converge-every") == 0 && arg + 1 < argc)
+        {
+            monitor.every = atoll(argv[++arg]);
+            valid = monitor.every > 0;
+        }
+        else if(strcmp(argv[arg], "--deadline") == 0 && arg + 1 < argc)
+        {
+            monitor.deadline = atof(argv[++arg]);
+            valid = monitor.deadline > 0;
+        }
+        else if(strcmp(argv[arg], "--timelapse") == 0 && arg + 1 < argc)
+            timelapseFile = argv[++arg];
+        else if(strcmp(argv[arg], "--frame-every") == 0 && arg + 1 < argc)
+        {
+            recorder.every = atoll(argv[++arg]);
+            valid = recorder.every > 0;
+        }
+        else if(strcmp(argv[arg], "--keyframe-every") == 0 && arg + 1 < argc)
+        {
+            recorder.keyEvery = atoi(argv[++arg]);
+            valid = recorder.keyEvery > 0;
+        }
+        else if(strcmp(argv[arg], "--replay") == 0 && arg + 2 < argc)
+        {
+            replayFile = argv[++arg];
+            replayFrame = atoll(argv[++arg]);
+            valid = replayFrame >= 0;
+        }
+        else if(strcmp(argv[arg], "--image") == 0 && arg + 1 < argc)
+            imageFile = argv[++arg];
+        else if(strcmp(argv[arg], "--fused") == 0)
+            fused = true;
+        else if(strcmp(argv[arg], "--pyramid") == 0 && arg + 1 < argc)
+            pyramidFile = argv[++arg];
+        else if(strcmp(argv[arg], "--view") == 0 && arg + 1 < argc)
+            valid = parseView(argv[++arg], view);
+        else if(strcmp(argv[arg], "--walkers") == 0 && arg + 1 < argc)
+        {
+            walk.walkers = atoi(argv[++arg]);
+            valid = walk.walkers == 8 || walk.walkers == 16;
+        }
+        else if(strcmp(argv[arg], "--ordered-walkers") == 0)
+            walk.orderedWalkers = true;
+        else if(strcmp(argv[arg], "--cache-dir") == 0 && arg + 1 < argc)
+            cacheDir = argv[++arg];
+        else if(strcmp(argv[arg], "--analyze") == 0)
+            analyze = true;
+        else if(strcmp(argv[arg], "--coast-distance") == 0)
+            coastDistance = true;
+        else if(strcmp(argv[arg], "--smooth") == 0 && arg + 1 < argc)
+        {
+            arg++;
+            if(strcmp(argv[arg], "box") == 0)
+                smooth.kernel = SMOOTH_BOX;
+            else if(strcmp(argv[arg], "gauss") == 0)
+                smooth.kernel = SMOOTH_GAUSS;
+            else
+                valid = false;
+        }
+        else if(strcmp(argv[arg], "--smooth-radius") == 0 && arg + 1 < argc)
+        {
+            smooth.radius = atoi(argv[++arg]);
+            valid = smooth.radius >= 1 && smooth.radius <= MAX_SMOOTH_RADIUS;
+        }
+        else if(strcmp(argv[arg], "--land-fraction") == 0 && arg + 1 < argc)
+        {
+            landFraction = atof(argv[++arg]);
+            valid = landFraction > 0 && landFraction < 1;
+        }
+        else if(strcmp(argv[arg], "--erode") == 0 && arg + 1 < argc)
+        {
+            smooth.erodeIterations = atoi(argv[++arg]);
+            valid = smooth.erodeIterations > 0;
+        }
+        else if(strcmp(argv[arg], "--preview") == 0 && arg + 1 < argc)
+        {
+            preview.factor = atoi(argv[++arg]);
+            valid = preview.factor >= 2;
+        }
+        else if(strcmp(argv[arg], "--refine") == 0)
+            preview.refine = true;
+        else if(strcmp(argv[arg], "--compare") == 0)
+            preview.compare = true;
+        else if(strcmp(argv[arg], "--heightmap") == 0 && arg + 1 < argc)
+            heightmapFile = argv[++arg];
+        else if(strcmp(argv[arg], "--heightmap-max") == 0 && arg + 1 < argc)
+        {
+            heightmapMax = atoi(argv[++arg]);
+            valid = heightmapMax > 0;
+        }
+        else if(strcmp(argv[arg], "--shards") == 0 && arg + 1 < argc)
+        {
+            shards = atoi(argv[++arg]);
+            valid = shards > 0;
+        }
+        else if(strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc)
+        {
+            threads = atoi(argv[++arg]);
+            valid = threads > 0;
+        }
+        else if(strcmp(argv[arg], "--cache-size") == 0 && arg + 1 < argc)
+        {
+            cacheMegabytes = atoll(argv[++arg]);
+            valid = cacheMegabytes > 0;
+        }
+        else
+            valid = false;
+
+        if(!valid)
+        {
+            printf("Error -- Usage: <exe> [--check [--baseline file] [--tolerance pct] [--no-perf-gate]] [-s seed] [--stats] [--counters] [--layout rows|tile8|tile16|morton] [--neighborhood moore|vonneumann|hex] [--terrain classic|highlands|lowlands | --palette file] [--walkers 8|16 [--ordered-walkers]] [--cache-dir dir [--cache-size MB]] [--smooth box|gauss [--smooth-radius r]] [--erode n] [--land-fraction f] [--converge tol [--converge-every K]] [--deadline s] [--timelapse file [--frame-every N] [--keyframe-every M] | --replay file frame] [--analyze] [--coast-distance] [--compress file | --decode file] [--pyramid file] [--image file.ppm] [--fused] [--view x,y,w,h[,factor] | --view fit] [--preview k [--refine] [--compare]] [--heightmap file [--heightmap-max M]] [--shards n] [--threads n]\n"); //Anything that doesn't follow the format of the Usage will error
+            return 0;
+        }
+    }
+
+    //The palette is compiled before any input is asked for, so a broken file fails right away
+    TerrainPalette palette;
+    if(paletteFile)
+    {
+        if(!loadPalette(paletteFile, palette))
+            return 0;
+    }
+    else if(terrainScheme == TERRAIN_HIGHLANDS)
+        schemePalette<HighlandsTerrain>(palette);
+    else if(terrainScheme == TERRAIN_LOWLANDS)
+        schemePalette<LowlandsTerrain>(palette);
     else
+        schemePalette<ClassicTerrain>(palette);
+    compilePalette(palette);
+
+    //--check exits with 1 when a plane hash or the throughput is off, for scripts and CI; --no-perf-gate only warns
+    //about the throughput
+    if(check)
+        return runCheck(baselineFile, tolerance, perfGate, threads) ? 0 : 1;
+
+    //--decode only prints a compressed file back, no map is generated
+    if(decodeFile)
+    {
+        OutputWriter output("island.txt");
+        output.view = view;
+        output.threads = threads;
+        decodeArchive(decodeFile, palette, output);
+        return 0;
+    }
+    if(replayFile)
+    {
+        OutputWriter output("island.txt");
+        output.view = view;
+        output.threads = threads;
+        replayTimelapse(replayFile, replayFrame, output);
+        return 0;
+    }
+#ifndef ISLAND_RESULT_CACHE
+    if(cacheDir)
+    {
+        printf("Error -- --cache-dir is not supported on this platform.\n");
+        return 0;
+    }
+#endif
+#ifndef ISLAND_HEIGHTMAP
+    if(heightmapFile)
+    {
+        printf("Error -- --heightmap is not supported on this platform.\n");
+        return 0;
+    }
+#endif
+#ifndef ISLAND_SHARDS
+    if(shards > 0)
+    {
+        printf("Error -- --shards is not supported on this platform.\n");
+        return 0;
+    }
+#endif
+    if(shards > 0 && (timelapseFile || monitor.tolerance > 0 || monitor.deadline > 0))
+    {
+        printf("Error -- --shards can't be combined with --timelapse, --converge or --deadline.\n");
+        return 0;
+    }
+    if(preview.factor > 0 && (shards > 0 || timelapseFile || monitor.tolerance > 0 || monitor.deadline > 0))
     {
-        printf("Error -- Usage: <exe> [-s seed]\n"); //Anything that doesn't follow the format of the Usage will error
+        printf("Error -- --preview can't be combined with --shards, --timelapse, --converge or --deadline.\n");
         return 0;
     }
+    if((preview.refine || preview.compare) && preview.factor == 0)
+    {
+        printf("Error -- --refine and --compare need --preview.\n");
+        return 0;
+    }
+    if(heightmapMax > 0 && !heightmapFile)
+    {
+        printf("Error -- --heightmap-max needs --heightmap.\n");
+        return 0;
+    }
+    if(heightmapFile && preview.factor > 0)
+    {
+        printf("Error -- --heightmap can't be combined with --preview.\n");
+        return 0;
+    }
+    srand(seed);
 
     int width, height, xCor, yCor, zoneRadius, particleNum, particleLife, waterLine;
 
@@ -185,19 +1276,24 @@ int main(int argc, char** argv)
     }
 
     //Collects the waterline and checks that the input is between 40 and 200 and is a number
-    printf("Enter value for waterline (40-200): ");
-    cin >> waterLine;
-    while (cin.fail() || waterLine < 40 || waterLine > 200)
+    //With --land-fraction it is picked from the normalized map instead, so it is not asked for
+    waterLine = 0;
+    if(landFraction < 0)
     {
-        if(cin.fail() || waterLine < 40 || waterLine > 200)
-           printf("Error -- Entered a value less than 40 or greater than 200 for waterline, please re-input.\n");
         printf("Enter value for waterline (40-200): ");
-        cin.clear();
-        cin.ignore(256,'\n');
         cin >> waterLine;
-    } 
+        while (cin.fail() || waterLine < 40 || waterLine > 200)
+        {
+            if(cin.fail() || waterLine < 40 || waterLine > 200)
+               printf("Error -- Entered a value less than 40 or greater than 200 for waterline, please re-input.\n");
+            printf("Enter value for waterline (40-200): ");
+            cin.clear();
+            cin.ignore(256,'\n');
+            cin >> waterLine;
+        }
+    }
 
-    //Create the initial 2D int array and fill it with 0s
+    //Create the initial 2D int array and fill it with 0s, or with the heights of the --heightmap file
     int** map;
     map = new int*[height];
     for(int row = 0; row < height; row++)
@@ -211,323 +1307,4570 @@ int main(int argc, char** argv)
             map[row][col] = 0;
         }
     }
+    if(heightmapFile && !loadHeightmap(heightmapFile, map, width, height, heightmapMax, threads))
+        return 0;
 
     //Open a file called island.txt to output the maps to and create the Raw Grid, the Normalized Grid and generate the Polished Island
-    ofstream outFile("island.txt");
-    int** particleMap = makeParticleMap(map, width, height, xCor, yCor, zoneRadius, particleNum, particleLife, outFile);
-    int** normalizedMap = normalizeMap(particleMap, width, height, outFile);
-    generateIsland(normalizedMap, width, height, waterLine, outFile);
-    
-    //Close the output file and delete the 2D array
-    outFile.close();
-    for(int row = 0; row < height; row++)
+    //Both it and the console are written by a background thread while the next stage runs
+    OutputWriter output("island.txt");
+    output.view = view;
+    output.threads = threads;
+    RunStats stats;
+    stats.threads = threads;
+    PerfCounters perf;
+    long long before[PERF_COUNTERS];
+    if(countEvents)
+        openCounters(perf, stats.counters);
+    vector<unsigned int> labels;
+    vector<Component> components;
+    MapArchive archive;
+    archive.width = width;
+    archive.height = height;
+    MapArchive* archiving = archiveFile ? &archive : 0;
+    MapPyramid pyramid;
+    MapPyramid* pyramiding = 0;
+    if(pyramidFile)
     {
-      delete[] map[row];
+        startPyramid(pyramid, width, height);
+        pyramiding = &pyramid;
     }
-    delete[] map;
+    CacheParams params;
+    memset(&params, 0, sizeof(params));
+    params.width = width;
+    params.height = height;
+    params.windowX = xCor;
+    params.windowY = yCor;
+    params.radius = zoneRadius;
+    params.particles = particleNum;
+    params.maxLife = particleLife;
+    params.waterLine = landFraction < 0 ? waterLine : 0;
+    params.landFractionPpm = landFraction < 0 ? 0 : (int) (landFraction * 1e6 + 0.5);
+    params.seed = seed;
+    params.walkers = walk.walkers;
+    params.orderedWalkers = walk.walkers > 0 && walk.orderedWalkers;
+    params.smoothKernel = smooth.kernel;
+    params.smoothRadius = smooth.kernel != SMOOTH_NONE ? smooth.radius : 0;
+    params.erodeIterations = smooth.erodeIterations;
+    params.neighborhood = walk.neighborhood;
+    params.shards = shards;
+    if(timelapseFile)
+    {
+        if((long long) width * height >= (1LL << 31))
+        {
+            printf("Error -- --timelapse numbers cells with 32 bits and needs a smaller map.\n");
+            return 0;
+        }
+        if(!startTimelapse(recorder, timelapseFile, width, height, walk.layout, particleNum))
+            return 0;
+        monitor.recorder = &recorder;
+        cacheDir = 0; //the frames only come from walking, a cached result has none
+    }
+    if(monitor.tolerance > 0 || monitor.deadline > 0 || monitor.recorder)
+    {
+        startMonitor(monitor, width, height, particleNum);
+        walk.monitor = &monitor;
+    }
+    if(monitor.tolerance > 0)
+    {
+        params.convergeEvery = monitor.every;
+        params.convergePpm = (int) (monitor.tolerance * 1e6 + 0.5);
+    }
+    if(monitor.deadline > 0)
+        cacheDir = 0; //where a deadline stops the walk depends on the machine, so the result is not cached
+    if(preview.factor > 0)
+        cacheDir = 0; //a preview is quick to make again and is not the island the parameters stand for
+    if(heightmapFile)
+        cacheDir = 0; //the starting heights come from a file the parameters don't cover
+    params.paletteHash = palette.hash;
+    params.version = GENERATOR_VERSION;
 
-    return 0;
-}
+    FILE* image = 0;
+    if(imageFile && !startImage(imageFile, width, height, image))
+        return 0;
 
-//Method makeParticleMap will preform the particle roll algorithm and create a raw grid containing the raw numbers
-int** makeParticleMap(int** map, int width, int height, int windowX, int windowY, int radius, int numParticles, int maxLife, ofstream& outFile)
-{
-   
-    double r, theta;
-    int x, y;
-    const double PI = 3.1415926535897;
+    //The fused pass never builds the terrain map, so it can't feed the stages that need all of it
+    const char* unfused = cacheDir ? "--cache-dir" : archiving ? "--compress" : analyze ? "--analyze"
+                        : coastDistance ? "--coast-distance" : landFraction >= 0 ? "--land-fraction"
+                        : preview.compare ? "--compare" : 0;
+#ifndef ISLAND_FUSED_PIPELINE
+    unfused = "this platform";
+#endif
+    if(fused && unfused)
+    {
+        output.print(OUTPUT_CONSOLE, "(--fused is off: %s needs the whole terrain map.)\n", unfused);
+        fused = false;
+    }
 
-    //Will loop until all particles have been dropped
-    while(numParticles != 0)
-    { 
-        //Will loop over and over again if x or y is out of bounds of the 2D array until the coordinate is inside the bounds
-        do
+    //A cache hit prints the stored maps straight from the mapped file and skips the simulation
+    CacheEntry cached;
+    char** terrain = 0;
+    int** normalized = 0;        //the normalized map, for --compare
+    PreviewReport previewReport;
+    bool hit = cacheDir && openCacheEntry(cacheDir, params, cached);
+    if(hit)
+    {
+        const CacheHeader* header = (const CacheHeader*) cached.data;
+        stats.cache = "hit";
+        stats.particles = header->particles;
+        stats.particlesAsked = particleNum;
+        stats.steps = header->steps;
+        stats.deadEndKills = header->deadEndKills;
+        stats.deadEndCells = header->deadEndCells;
+        std::chrono::steady_clock::time_point stageStart = std::chrono::steady_clock::now();
+        output.print(OUTPUT_CONSOLE, "\n");
+        output.print(OUTPUT_BOTH, "Raw Grid:\n");
+        printGrid(cached.raw.data(), width, height, output);
+        stats.particleMapSeconds = secondsSince(stageStart);
+        stageStart = std::chrono::steady_clock::now();
+        output.print(OUTPUT_BOTH, "Normalized Grid:\n");
+        printGrid(cached.normalized.data(), width, height, output);
+        for(int row = 0; archiving && row < height; row++)
+            encodeNormalizedRow(archive, cached.normalized[row]);
+        for(int row = 0; pyramiding && row < height; row++)
+            memcpy(&pyramid.levels[0].maxHeight[(size_t) row * width], cached.normalized[row], width);
+        stats.normalizeSeconds = secondsSince(stageStart);
+        stageStart = std::chrono::steady_clock::now();
+        terrain = cached.terrain.data();
+        printIsland(terrain, width, height, palette, output);
+        for(int row = 0; archiving && row < height; row++)
+            encodeTerrainRow(archive, terrain[row]);
+        for(int row = 0; pyramiding && row < height; row++)
+            memcpy(&pyramid.levels[0].terrain[(size_t) row * width], terrain[row], width);
+        stats.islandSeconds = secondsSince(stageStart);
+    }
+    else
+    {
+        std::chrono::steady_clock::time_point stageStart = std::chrono::steady_clock::now();
+        readCounters(perf, before);
+        int** particleMap = map;
+        if(preview.factor > 0)
+            previewParticleMap(map, width, height, xCor, yCor, zoneRadius, particleNum, particleLife, waterLine, landFraction, walk, preview, previewReport, output, stats);
+        else if(shards > 0)
         {
-            r = radius * sqrt(frand());
-            theta = frand() * 2 * PI;
-            x = (int) (windowX + r * cos(theta));
-            y = (int) (windowY + r * sin(theta));
-        } while (x >= width || x < 0 || y >= height || y < 0);
+            if(!shardParticleMap(map, width, height, xCor, yCor, zoneRadius, particleNum, particleLife, walk, seed, shards, threads, output, stats))
+                return 0;
+        }
+        else
+            makeParticleMap(map, width, height, xCor, yCor, zoneRadius, particleNum, particleLife, walk, output, stats);
+        stats.particleMapSeconds = secondsSince(stageStart);
+        countStage(perf, before, stats.counters, STAGE_WALK);
 
-        map[y][x]++; //Increment the initial particle dropped
+        //normalizeMap overwrites the counts, so keep the raw plane for the cache first
+        vector<int> raw;
+        if(cacheDir)
+        {
+            raw.resize((size_t) width * height);
+            for(int row = 0; row < height; row++)
+                memcpy(&raw[(size_t) row * width], particleMap[row], width * sizeof(int));
+        }
 
-        //Loop through a particle's life until it dies
-        for(int i = maxLife; i > 0; i--)
+        if(smooth.kernel != SMOOTH_NONE || smooth.erodeIterations > 0)
         {
-            //boolean flags for checking valid directions
-            bool valid = false;
-            bool invalidN = false;
-            bool invalidNE = false;
-            bool invalidE = false;
-            bool invalidSE = false;
-            bool invalidS = false;
-            bool invalidSW = false;
-            bool invalidW = false;
-            bool invalidNW = false;
-            bool zeroValid = false;
-            float randomNum;
-
-            //Loop that will randomly look into the Moore's neighborhood of a coordinate until it finds a direction
-            //that is valid or kills the particle if there are no valid moves
-            //The loop will only break when a valid direction is found and bool valid is set true or 
-            //all directions are invalid with their respective bool flags being set true
-            while(!valid && !zeroValid)
-            {
-                //Creates a random number between 1-8 with each number being associated to a direction
-                randomNum = (rand() % 8) + 1; 
-                if(randomNum == 1)
-                {
-                    if(moveExists(map, width, height, x, y, x , y - 1)) //Moves north
-                    {
-                        map[y-1][x]++;
-                        y--;
-                        valid = true; 
-                    }
-                    else    
-                        invalidN = true; 
-                }   
-                else if(randomNum == 2)
-                {
-                    if(moveExists(map, width, height, x, y, x + 1 , y - 1)) //Moves north east
-                    {
-                        map[y-1][x+1]++;
-                        y--;
-                        x++;
-                        valid = true;
-                    }
-                    else
-                        invalidNE = true;
-                }
-                else if(randomNum == 3)
-                {
-                    if(moveExists(map, width, height, x, y, x + 1 , y)) //Moves east
-                    {
-                        map[y][x+1]++;
-                        x++;
-                        valid = true;
-                    }
-                    else
-                        invalidE = true;
-                }
-                else if(randomNum == 4)
-                {
-                    if(moveExists(map, width, height, x, y, x + 1, y + 1)) //Moves south east
-                    {
-                        map[y+1][x+1]++;
-                        y++;
-                        x++;
-                        valid = true;
-                    }
-                    else
-                        invalidSE = true;
-                }
-                else if(randomNum == 5)
-                {
-                    if(moveExists(map, width, height, x, y, x, y + 1)) //Moves south
-                    {  
-                        map[y+1][x]++;
-                        y++;
-                        valid = true;
-                    }
-                    else
-                        invalidS = true;
-                }
-                else if(randomNum == 6)
-                {
-                    if(moveExists(map, width, height, x, y, x - 1, y + 1)) //Moves south west
-                    {
-                        map[y+1][x-1]++;
-                        y++;
-                        x--;
-                        valid = true;
-                    }
-                    else
-                        invalidSW = true;
-                }
-                else if(randomNum == 7)
-                {
-                    if(moveExists(map, width, height, x, y, x - 1, y)) //Moves west
-                    {
-                        map[y][x-1]++;
-                        x--;
-                        valid = true;
-                    }
-                    else
-                        invalidW = true;
-                }
-                else if(randomNum == 8)
-                {
-                    if(moveExists(map, width, height, x, y, x - 1, y - 1)) //Moves north west
-                    {
-                        map[y-1][x-1]++;
-                        y--;
-                        x--;
-                        valid = true;
-                    }
-                    else
-                        invalidNW = true;
-                }
-                zeroValid = invalidN && invalidNE && invalidE && invalidSE && invalidS && invalidSW && invalidW && invalidNW;
-                if(zeroValid) //If there are no valid directions to move to i will be set to 0 which kills the particle
-                    i = 0;
-            } //end of valid loop
-        } // end of maxLife loop
-        numParticles--;
-    } //end of numParticles loop
+            stageStart = std::chrono::steady_clock::now();
+            readCounters(perf, before);
+            smoothMap(particleMap, width, height, smooth, threads);
+            stats.smoothSeconds = secondsSince(stageStart);
+            countStage(perf, before, stats.counters, STAGE_SMOOTH);
+        }
+
+#ifdef ISLAND_FUSED_PIPELINE
+        if(fused)
+        {
+            stageStart = std::chrono::steady_clock::now();
+            readCounters(perf, before);
+            if(!fusedPipeline(particleMap, width, height, waterLine, palette, threads, pyramiding, image, output))
+                return 0;
+            stats.fusedSeconds = secondsSince(stageStart);
+            countStage(perf, before, stats.counters, STAGE_FUSED);
+        }
+        else
+#endif
+        {
+            stageStart = std::chrono::steady_clock::now();
+            readCounters(perf, before);
+            long long histogram[256];
+            int** normalizedMap = normalizeMap(particleMap, width, height, threads, histogram, archiving, pyramiding, output);
+            normalized = normalizedMap;
+            stats.normalizeSeconds = secondsSince(stageStart);
+            countStage(perf, before, stats.counters, STAGE_NORMALIZE);
+            if(landFraction >= 0)
+            {
+                waterLine = chooseWaterLine(histogram, (long long) width * height, landFraction);
+                output.print(OUTPUT_CONSOLE, "Waterline %d picked for a land fraction of %g.\n", waterLine, landFraction);
+            }
+            stageStart = std::chrono::steady_clock::now();
+            readCounters(perf, before);
+            terrain = generateIsland(normalizedMap, width, height, waterLine, palette, archiving, pyramiding, output);
+            stats.islandSeconds = secondsSince(stageStart);
+            countStage(perf, before, stats.counters, STAGE_ISLAND);
+
+            if(cacheDir && storeCacheEntry(cacheDir, params, raw.data(), normalizedMap, terrain, stats))
+            {
+                stats.cache = "stored";
+                evictCache(cacheDir, cacheMegabytes << 20);
+            }
+        }
+    }
+
+    //Optional stages that work on the finished terrain map
+    if(preview.compare && normalized)
+        comparePreview(normalized, terrain, width, height, xCor, yCor, zoneRadius, particleNum, particleLife, waterLine, landFraction, walk, smooth, palette, seed, threads, previewReport, output);
+    if(image && fused)
+        fclose(image);
+    else if(image)
+        writeImage(terrain, width, height, palette, image);
+    if(archiving && writeArchive(archive, archiveFile))
+    {
+        long long cells = (long long) width * height;
+        output.print(OUTPUT_CONSOLE, "\nCompressed to %s: normalized %lld -> %llu bytes (%.1fx), terrain %lld -> %llu bytes (%.1fx), %.1f MB/s\n",
+                     archiveFile, cells, (unsigned long long) archive.normalized.bytes.size(), (double) cells / std::max<size_t>(archive.normalized.bytes.size(), 1),
+                     cells, (unsigned long long) archive.terrain.bytes.size(), (double) cells / std::max<size_t>(archive.terrain.bytes.size(), 1),
+                     archive.seconds > 0 ? 2.0 * cells / archive.seconds / 1e6 : 0.0);
+    }
+    if(pyramiding)
+    {
+        reducePyramid(pyramid, threads);
+        if(writePyramid(pyramid, pyramidFile))
+            output.print(OUTPUT_CONSOLE, "\nWrote %d zoom levels to %s (%.3f s to reduce).\n", (int) pyramid.levels.size(), pyramidFile, pyramid.seconds);
+    }
+    if(analyze)
+    {
+        std::chrono::steady_clock::time_point stageStart = std::chrono::steady_clock::now();
+        readCounters(perf, before);
+        labelComponents(terrain, width, height, palette, threads, labels, components);
+        stats.analyzeSeconds = secondsSince(stageStart);
+        countStage(perf, before, stats.counters, STAGE_ANALYZE);
+        output.drain(); //the report prints straight to the console, after the island
+        reportComponents(components, "island_components.txt");
+    }
+    if(coastDistance)
+    {
+        std::chrono::steady_clock::time_point stageStart = std::chrono::steady_clock::now();
+        readCounters(perf, before);
+        vector<unsigned short> distances;
+        distanceToCoast(terrain, width, height, palette, threads, distances);
+        stats.distanceSeconds = secondsSince(stageStart);
+        countStage(perf, before, stats.counters, STAGE_DISTANCE);
+        writeDistancePlane(distances, width, height, "island_coast.pgm");
+    }
+
+    if(hit)
+        closeCacheEntry(cached);
+    else if(terrain)
+    {
+        for(int row = 0; row < height; row++)
+        {
+            delete[] terrain[row];
+        }
+        delete[] terrain;
+    }
+    output.close();
+    closeCounters(perf);
+    stats.formatBytes = output.formatBytes;
+    stats.formatSeconds = output.formatSeconds;
+    if(showStats)
+    {
+        printStats(stats, width, height);
+        writeDeadEndMap(stats.deadEnds, width, height, "island_deadends.pbm");
+    }
+    
+    //Delete the 2D array
+    for(int row = 0; row < height; row++)
+    {
+      delete[] map[row];
+    }
+    delete[] map;
+
+    return 0;
+}
+#endif
+
+//Method makeParticleMap will preform the particle roll algorithm and create a raw grid containing the raw numbers
+//The walk itself runs on a copy of the grid in the selected memory layout and is copied back row-major at the end
+int** makeParticleMap(int** map, int width, int height, int windowX, int windowY, int radius, int numParticles, int maxLife, const WalkOptions& walk, OutputWriter& output, RunStats& stats)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    stats.particles = numParticles;
+    stats.particlesAsked = numParticles;
+    if(walk.monitor)
+        walk.monitor->start = start;
+
+    //A drop zone that misses the grid has no cell to drop on, and the rejection loop would look for one forever
+    if(numParticles > 0 && (walk.dropCells ? walk.dropCells->empty() : !dropZoneOnGrid(width, height, windowX, windowY, radius)))
+        numParticles = stats.particles = 0;
+
+    //Precompute the drop-zone alias table once; positions are then drawn in O(1) without rejections
+    DropSampler sampler;
+    if(numParticles > 0 && walk.dropCells)
+        uniformDropSampler(sampler, *walk.dropCells);
+    else if(numParticles > 0)
+        buildDropSampler(sampler, width, height, windowX, windowY, radius);
+
+    //Every layout and neighborhood pair is its own specialized walk, picked from this table
+    typedef void (*WalkKernel)(int**, int, int, DropSampler&, int, int, int, int, int, const WalkOptions&, RunStats&);
+    static const WalkKernel kernels[3][4] =
+    {
+        {runWalk<RowLayout, Moore8>, runWalk<TileLayout<3>, Moore8>, runWalk<TileLayout<4>, Moore8>, runWalk<MortonLayout, Moore8>},
+        {runWalk<RowLayout, VonNeumann4>, runWalk<TileLayout<3>, VonNeumann4>, runWalk<TileLayout<4>, VonNeumann4>, runWalk<MortonLayout, VonNeumann4>},
+        {runWalk<RowLayout, Hex6>, runWalk<TileLayout<3>, Hex6>, runWalk<TileLayout<4>, Hex6>, runWalk<MortonLayout, Hex6>}
+    };
+    static const char* layoutNames[4] = {"rows", "tile8", "tile16", "morton"};
+    static const char* neighborhoodNames[3] = {Moore8::name, VonNeumann4::name, Hex6::name};
+    stats.layout = layoutNames[walk.layout];
+    stats.neighborhood = neighborhoodNames[walk.neighborhood];
+    kernels[walk.neighborhood][walk.layout](map, width, height, sampler, windowX, windowY, radius, numParticles, maxLife, walk, stats);
+    stats.simulateSeconds = secondsSince(start);
+    if(walk.monitor && walk.monitor->stopReason)
+    {
+        //The rest of the particles would have cost about what the dropped ones did each
+        const WalkMonitor& monitor = *walk.monitor;
+        stats.particles = monitor.dropped;
+        stats.stopReason = monitor.stopReason;
+        stats.savedSeconds = stats.simulateSeconds * (numParticles - monitor.dropped) / std::max(monitor.dropped, 1LL);
+        output.print(OUTPUT_CONSOLE, "\nWalk stopped early (%s) after %lld of %d particles.\n", monitor.stopReason, monitor.dropped, numParticles);
+    }
+    if(walk.monitor)
+        stats.shapeDelta = walk.monitor->delta;
+    if(walk.monitor && walk.monitor->recorder)
+    {
+        FrameRecorder& recorder = *walk.monitor->recorder;
+        finishTimelapse(recorder);
+        stats.timelapseFrames = recorder.offsets.size();
+        stats.timelapseSeconds = recorder.seconds;
+        stats.timelapseBytes = recorder.offset;
+    }
 
-    //Print the raw grid to the console and outFile
-    printf("\nRaw Grid:\n");
-    outFile << "Raw Grid:" << endl;    
-    printGrid(map, width, height, outFile);
+    //Print the raw grid to the console and island.txt
+    output.print(OUTPUT_CONSOLE, "\n");
+    output.print(OUTPUT_BOTH, "Raw Grid:\n");
+    printGrid(map, width, height, output);
     return map;
 } //End of makeParticleMap method
 
-//Method normalizeMap will use the largest number and normalize all elements in the 2D int array to 255
-int** normalizeMap(int** norMap, int width, int height, ofstream& outFile)
+//Method shardParticleMap will split the particles over worker processes and sum their grids into map
+//Shard k of n forks, seeds rand() with seed + k * 2654435761 and walks particles [k * count / n, (k + 1) * count / n)
+//on a copy of the starting map in a shared anonymous mapping, so a shard never sees the others' deposits: the sum is
+//a bulk-deposit approximation of one walk, exactly reproducible for a seed and shard count (one shard is the plain
+//walk). Each shard takes the starting heights off its grid again, so the map keeps them once, under every deposit.
+//A shard that crashes or is killed is simply started again, up to SHARD_ATTEMPTS times, since its grid only depends
+//on its index. The parent then adds the grids on its threads and prints the raw grid as makeParticleMap does
+bool shardParticleMap(int** map, int width, int height, int windowX, int windowY, int radius, int numParticles, int maxLife, const WalkOptions& walk, unsigned int seed, int shards, int threads, OutputWriter& output, RunStats& stats)
 {
-    int maxVal = findMax(norMap, width, height);
-    for(int row = 0; row < height; row++)
+#ifdef ISLAND_SHARDS
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    size_t cells = (size_t) width * height;
+    size_t resultBytes = (shards * sizeof(ShardResult) + 63) / 64 * 64;
+    size_t bytes = resultBytes + shards * cells * sizeof(int);
+    void* segment = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(segment == MAP_FAILED)
     {
-        for(int col = 0; col < width; col++)
+        printf("Error -- Could not map %.1f MB for the shard grids.\n", bytes / 1048576.0);
+        return false;
+    }
+    ShardResult* results = (ShardResult*) segment;
+    int* planes = (int*) ((char*) segment + resultBytes);
+    output.drain(); //the writer thread sits idle while the shards fork
+    fflush(stdout);
+
+    //A shard runs in a child process and leaves its grid and counters in the segment
+    vector<pid_t> workers(shards, -1);
+    vector<int> attempts(shards, 0);
+    auto startShard = [&](int shard)
+    {
+        pid_t pid = fork();
+        if(pid == 0)
         {
-            norMap[row][col] = ((double) norMap[row][col] / maxVal) * 255; //This will normalize a coordinate to 255
+            int* plane = planes + shard * cells;
+            vector<int*> rows(height);
+            for(int row = 0; row < height; row++)
+            {
+                rows[row] = plane + (size_t) row * width;
+                memcpy(rows[row], map[row], width * sizeof(int));
+            }
+            srand(seed + shard * 2654435761u);
+            int first = (int) ((long long) numParticles * shard / shards);
+            int end = (int) ((long long) numParticles * (shard + 1) / shards);
+            OutputWriter muted(0);
+            RunStats shardStats;
+            makeParticleMap(rows.data(), width, height, windowX, windowY, radius, end - first, maxLife, walk, muted, shardStats);
+            for(int row = 0; row < height; row++)
+                for(int col = 0; col < width; col++)
+                    rows[row][col] -= map[row][col];
+            ShardResult& result = results[shard];
+            result.particles = shardStats.particles;
+            result.steps = shardStats.steps;
+            result.deadEndKills = shardStats.deadEndKills;
+            result.seconds = shardStats.simulateSeconds;
+            result.layout = shardStats.layout;
+            result.neighborhood = shardStats.neighborhood;
+            __atomic_store_n(&result.done, 1, __ATOMIC_RELEASE);
+            _exit(0);
         }
+        workers[shard] = pid;
+        attempts[shard]++;
+        return pid > 0;
+    };
+    bool failed = false;
+    int running = 0;
+    for(int shard = 0; shard < shards && !failed; shard++)
+    {
+        failed = !startShard(shard);
+        running += !failed;
     }
 
-    //Print the normalized grid to the console and outFile
-    printf("Normalized Grid:\n");
-    outFile << "Normalized Grid:" << endl;
-    printGrid(norMap, width, height, outFile);
-    return norMap;
-} //End of normalizeMap method
+    //Wait for every shard, starting again the ones that died before they finished
+    while(running > 0)
+    {
+        int status;
+        pid_t pid = wait(&status);
+        if(pid < 0)
+            break;
+        running--;
+        int shard = std::find(workers.begin(), workers.end(), pid) - workers.begin();
+        if(shard == shards)
+            continue;
+        workers[shard] = -1;
+        if(failed || (WIFEXITED(status) && WEXITSTATUS(status) == 0 && __atomic_load_n(&results[shard].done, __ATOMIC_ACQUIRE)))
+            continue;
+        if(attempts[shard] >= SHARD_ATTEMPTS)
+        {
+            printf("Error -- Shard %d failed %d times.\n", shard, attempts[shard]);
+            failed = true;
+            continue;
+        }
+        printf("Shard %d stopped without finishing, starting it again.\n", shard);
+        fflush(stdout);
+        stats.shardRetries++;
+        failed = !startShard(shard);
+        running += !failed;
+    }
+    if(failed)
+    {
+        printf("Error -- The shards could not finish.\n");
+        munmap(segment, bytes);
+        return false;
+    }
+    stats.simulateSeconds = secondsSince(start);
+    stats.shards = shards;
+    stats.particles = stats.particlesAsked = 0;
+    stats.fastestShard = stats.slowestShard = results[0].seconds;
+    for(int shard = 0; shard < shards; shard++)
+    {
+        stats.fastestShard = std::min(stats.fastestShard, results[shard].seconds);
+        stats.slowestShard = std::max(stats.slowestShard, results[shard].seconds);
+        stats.particles += results[shard].particles;
+        stats.steps += results[shard].steps;
+        stats.deadEndKills += results[shard].deadEndKills;
+        stats.layout = results[shard].layout;
+        stats.neighborhood = results[shard].neighborhood;
+    }
+    stats.particlesAsked = numParticles;
 
-//Method findMax will search and find the largest number in a 2D int array
-int findMax(int** map, int width, int height)
+    //Sum the shard grids into the map, a band of rows per thread
+    std::chrono::steady_clock::time_point mergeStart = std::chrono::steady_clock::now();
+    parallelBands(height, threads, [&](int, int firstRow, int endRow)
+    {
+        for(int row = firstRow; row < endRow; row++)
+        {
+            for(int shard = 0; shard < shards; shard++)
+                addPlane(map[row], planes + shard * cells + (size_t) row * width, width);
+        }
+    });
+    stats.mergeSeconds = secondsSince(mergeStart);
+    munmap(segment, bytes);
+
+    output.print(OUTPUT_CONSOLE, "\n");
+    output.print(OUTPUT_BOTH, "Raw Grid:\n");
+    printGrid(map, width, height, output);
+    return true;
+#else
+    (void) map; (void) width; (void) height; (void) windowX; (void) windowY; (void) radius; (void) numParticles;
+    (void) maxLife; (void) walk; (void) seed; (void) shards; (void) threads; (void) output; (void) stats;
+    return false;
+#endif
+} //End of shardParticleMap method
+
+//Method addPlane will add a row of shard counts into a row of the map, four counts at a time with SSE2 on x86
+void addPlane(int* __restrict out, const int* __restrict in, int width)
 {
-    int largest = map[0][0];
+    int col = 0;
+#if defined(ISLAND_AVX2_KERNEL) && defined(__SSE2__)
+    for(; col + 4 <= width; col += 4)
+    {
+        __m128i sum = _mm_add_epi32(_mm_loadu_si128((const __m128i*) (out + col)), _mm_loadu_si128((const __m128i*) (in + col)));
+        _mm_storeu_si128((__m128i*) (out + col), sum);
+    }
+#endif
+    for(; col < width; col++)
+        out[col] += in[col];
+} //End of addPlane method
+
+//Method previewParticleMap will walk a grid preview.factor times smaller and scale the counts back up into map
+//The small walk keeps the island's proportions: the drop zone is scaled down with the grid, a particle's life shrinks
+//with the cell size so it rolls as far, and there are factor^2 fewer particles so each small cell gets the share of
+//its factor^2 cells. Its counts are then bilinearly upsampled and multiplied by factor, which puts them on the scale
+//of the full walk (that deposits factor times more per cell)
+//--refine then walks the coast band again at full resolution: the cells within COAST_BAND normalized levels of the
+//waterline give up half their upsampled count, and as many full-size particles as that mass makes up (each deposits
+//life + 1 times) are dropped uniformly on the band and walked over the upsampled map, so the coast gets full-resolution
+//detail while the rest of the map keeps the preview
+void previewParticleMap(int** map, int width, int height, int windowX, int windowY, int radius, int numParticles, int maxLife, int waterLine, double landFraction, const WalkOptions& walk, const PreviewOptions& preview, PreviewReport& report, OutputWriter& output, RunStats& stats)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int factor = preview.factor;
+    int smallWidth = (width + factor - 1) / factor, smallHeight = (height + factor - 1) / factor;
+    report.width = smallWidth;
+    report.height = smallHeight;
+    report.radius = smallWidth < 2 || smallHeight < 2 ? 2 : std::min(std::max(2, (radius + factor / 2) / factor), std::min(smallWidth, smallHeight));
+    report.particles = (int) ((long long) numParticles / ((long long) factor * factor));
+    report.maxLife = maxLife / factor;
+    vector<int> small((size_t) smallWidth * smallHeight, 0);
+    vector<int*> smallRows(smallHeight);
+    for(int row = 0; row < smallHeight; row++)
+        smallRows[row] = &small[(size_t) row * smallWidth];
+    OutputWriter muted(0);
+    WalkOptions smallWalk = walk;
+    smallWalk.dropCells = 0;
+    RunStats smallStats;
+    makeParticleMap(smallRows.data(), smallWidth, smallHeight, std::min(windowX / factor, smallWidth), std::min(windowY / factor, smallHeight),
+                    report.radius, report.particles, report.maxLife, smallWalk, muted, smallStats);
+
+    //Only the walk counters carry over; the small walk's dead ends are cells of the small grid, not of map
+    stats.particles = smallStats.particles;
+    stats.particlesAsked = smallStats.particlesAsked;
+    stats.steps = smallStats.steps;
+    stats.deadEndKills = smallStats.deadEndKills;
+    stats.layout = smallStats.layout;
+    stats.neighborhood = smallStats.neighborhood;
+    stats.walkers = smallStats.walkers;
+    stats.orderedWalkers = smallStats.orderedWalkers;
+    stats.deadEnds.clear();
+    stats.deadEndCells = -1;
+
+    //Bilinear upsampling, sampling the small grid at the center of every full-size cell
     for(int row = 0; row < height; row++)
     {
+        double fy = std::min(std::max((row + 0.5) / factor - 0.5, 0.0), smallHeight - 1.0);
+        int y0 = (int) fy, y1 = std::min(y0 + 1, smallHeight - 1);
+        double ty = fy - y0;
         for(int col = 0; col < width; col++)
         {
-            if(map[row][col] > largest)
-                largest = map[row][col];
+            double fx = std::min(std::max((col + 0.5) / factor - 0.5, 0.0), smallWidth - 1.0);
+            int x0 = (int) fx, x1 = std::min(x0 + 1, smallWidth - 1);
+            double tx = fx - x0;
+            double top = smallRows[y0][x0] + (smallRows[y0][x1] - smallRows[y0][x0]) * tx;
+            double bottom = smallRows[y1][x0] + (smallRows[y1][x1] - smallRows[y1][x0]) * tx;
+            map[row][col] = (int) ((top + (bottom - top) * ty) * factor + 0.5);
         }
     }
-    return largest;
-} //End of findMax method
+    report.previewSeconds = secondsSince(start);
 
-//Method moveExists will check if a valid move exists on a particular coordinate
-bool moveExists(int** map, int width, int height, int x, int y, int newX, int newY)
-{
-    if((x >= 0 && x < width) && (y >= 0 && y < height) && (newX >= 0 && newX < width) && (newY >= 0 && newY < height) ) //Checks bounds
-        if(map[newY][newX] <= map[y][x]) //Checks if the direction is smaller or equal to the current point
-            return true;
+    if(preview.refine)
+    {
+        start = std::chrono::steady_clock::now();
+        int maxVal = std::max(findMax(map, width, height), 1);
+        int line = waterLine;
+        if(landFraction >= 0)
+        {
+            long long histogram[256] = {};
+            for(int row = 0; row < height; row++)
+            {
+                for(int col = 0; col < width; col++)
+                    histogram[(int) (((double) map[row][col] / maxVal) * 255)]++;
+            }
+            line = chooseWaterLine(histogram, (long long) width * height, landFraction);
+        }
+        vector<unsigned int> band;
+        long long mass = 0;
+        for(int row = 0; row < height; row++)
+        {
+            for(int col = 0; col < width; col++)
+            {
+                int value = ((double) map[row][col] / maxVal) * 255; //the level normalizeMap will give the cell
+                if(abs(value - line) > COAST_BAND)
+                    continue;
+                band.push_back((unsigned int) row * width + col);
+                mass += map[row][col] - map[row][col] / 2;
+                map[row][col] /= 2;
+            }
+        }
+        report.bandCells = band.size();
+        report.refineParticles = band.empty() ? 0 : std::max(mass / (maxLife + 1), 1LL);
+        WalkOptions bandWalk = walk;
+        bandWalk.dropCells = &band;
+        RunStats refineStats;
+        makeParticleMap(map, width, height, windowX, windowY, radius, (int) std::min<long long>(report.refineParticles, INT_MAX), maxLife, bandWalk, muted, refineStats);
+        stats.particles += refineStats.particles;
+        stats.steps += refineStats.steps;
+        stats.deadEndKills += refineStats.deadEndKills;
+        stats.deadEnds.swap(refineStats.deadEnds); //the refine walk ran on map itself, so its dead ends are the map's
+        stats.deadEndCells = refineStats.deadEndCells;
+        report.refineSeconds = secondsSince(start);
+    }
+    stats.simulateSeconds = report.previewSeconds + report.refineSeconds;
 
-    return false;
-} //End of moveExists method
+    output.print(OUTPUT_CONSOLE, "\nPreview at 1/%d: a %dx%d walk of %d particles with life %d, %.3f s", factor, smallWidth, smallHeight,
+                 report.particles, report.maxLife, report.previewSeconds);
+    if(preview.refine)
+        output.print(OUTPUT_CONSOLE, "; coast band of %lld cells refined with %lld particles, %.3f s", report.bandCells,
+                     report.refineParticles, report.refineSeconds);
+    output.print(OUTPUT_CONSOLE, ".\n");
+    output.print(OUTPUT_CONSOLE, "\n");
+    output.print(OUTPUT_BOTH, "Raw Grid:\n");
+    printGrid(map, width, height, output);
+} //End of previewParticleMap method
 
-void generateIsland(int** map, int width, int height, int waterLine, ofstream& outFile)
+//Method comparePreview will run the full-resolution walk and the stages after it without output, and print how long
+//it took next to the preview and how close the preview came: the share of cells with the same terrain, the
+//intersection over union of the land, and the correlation of the normalized heights
+void comparePreview(int** normalized, char** terrain, int width, int height, int windowX, int windowY, int radius, int numParticles, int maxLife, int waterLine, double landFraction, const WalkOptions& walk, const SmoothOptions& smooth, const TerrainPalette& palette, unsigned int seed, int threads, const PreviewReport& report, OutputWriter& output)
 {
-    int landZone = 255 - waterLine;
+    size_t cells = (size_t) width * height;
+    vector<int> full(cells, 0);
+    vector<int*> rows(height);
+    for(int row = 0; row < height; row++)
+        rows[row] = &full[(size_t) row * width];
+    OutputWriter muted(0);
+    RunStats fullStats;
+    srand(seed);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    makeParticleMap(rows.data(), width, height, windowX, windowY, radius, numParticles, maxLife, walk, muted, fullStats);
+    double fullSeconds = secondsSince(start);
+    if(smooth.kernel != SMOOTH_NONE || smooth.erodeIterations > 0)
+        smoothMap(rows.data(), width, height, smooth, threads);
+    long long histogram[256];
+    normalizeMap(rows.data(), width, height, threads, histogram, 0, 0, muted);
+    int fullWaterLine = landFraction < 0 ? waterLine : chooseWaterLine(histogram, (long long) cells, landFraction);
+    char glyphs[256];
+    glyphTable(palette, fullWaterLine, glyphs);
+    bool water[256] = {};
+    for(size_t k = 0; k < palette.classes.size(); k++)
+        water[(unsigned char) palette.classes[k].glyph] = palette.classes[k].water;
 
-    //Dynmatically create a 2D char array for the island generation
-    char** island;
-    island = new char*[height];
+    long long same = 0, both = 0, either = 0;
+    double sumA = 0, sumB = 0, sumAA = 0, sumBB = 0, sumAB = 0;
     for(int row = 0; row < height; row++)
     {
-        island[row] = new char[width];
+        for(int col = 0; col < width; col++)
+        {
+            unsigned char mine = terrain[row][col], theirs = glyphs[rows[row][col]];
+            same += mine == theirs;
+            both += !water[mine] && !water[theirs];
+            either += !water[mine] || !water[theirs];
+            double a = normalized[row][col], b = rows[row][col];
+            sumA += a;
+            sumB += b;
+            sumAA += a * a;
+            sumBB += b * b;
+            sumAB += a * b;
+        }
     }
+    double varA = sumAA - sumA * sumA / cells, varB = sumBB - sumB * sumB / cells;
+    double correlation = varA > 0 && varB > 0 ? (sumAB - sumA * sumB / cells) / sqrt(varA * varB) : 1.0;
+    double previewSeconds = report.previewSeconds + report.refineSeconds;
+    output.print(OUTPUT_CONSOLE, "\nPreview %.3f s, full walk %.3f s (%.1fx faster). Terrain agreement %.1f%%, land IoU %.3f, height correlation %.3f.\n",
+                 previewSeconds, fullSeconds, previewSeconds > 0 ? fullSeconds / previewSeconds : 0.0, 100.0 * same / cells,
+                 either > 0 ? (double) both / either : 1.0, correlation);
+} //End of comparePreview method
+
+//Method runWalk will build the grid layout and run walkParticles with it, one instance per dispatch table entry
+template<class Layout, class Hood>
+void runWalk(int** map, int width, int height, DropSampler& sampler, int windowX, int windowY, int radius, int numParticles, int maxLife, const WalkOptions& walk, RunStats& stats)
+{
+    walkParticles<Layout, Hood>(Layout(width, height), map, width, height, sampler, windowX, windowY, radius, numParticles, maxLife, walk, stats);
+} //End of runWalk method
 
-    //2D Char array with it's elements assigned accordingly
-    for(int row = 0; row < height; row++) 
+//Method walkParticles will drop and walk every particle on a copy of the grid stored in the given layout
+//Each cell also carries a byte with one bit per direction that is currently a valid move; a zero byte flags a dead end
+//(every in-bounds neighbor in the Hood neighborhood is higher) so a particle standing on it dies with one load. The bits
+//are refreshed around every deposit
+template<class Layout, class Hood>
+void walkParticles(const Layout& grid, int** map, int width, int height, DropSampler& sampler, int windowX, int windowY, int radius, int numParticles, int maxLife, const WalkOptions& walk, RunStats& stats)
+{
+    int x, y;
+    vector<int> counts(grid.size, 0);
+    vector<unsigned char> valid(grid.size + 3, 0); //padded so 32-bit gathers of the last cell stay in bounds
+    for(int row = 0; row < height; row++)
     {
         for(int col = 0; col < width; col++)
         {
-            if(map[row][col] < (0.5 * waterLine))
-                island[row][col] = '#';
-            else if(map[row][col] >= (0.5 * waterLine) && map[row][col] <= waterLine)
-                island[row][col] = '~';
-            else if(map[row][col] > waterLine && map[row][col] < (waterLine + (0.15 * landZone)))
-                island[row][col] = '.';
-            else if(map[row][col] > waterLine && map[row][col] >= (waterLine + (0.15 * landZone)) && map[row][col] < (waterLine + (0.4 * landZone)))
-                island[row][col] = '-';
-            else if(map[row][col] > waterLine && map[row][col] >= (waterLine + (0.4 * landZone)) && map[row][col] < (waterLine + (0.8 * landZone)))
-                island[row][col] = '*';
-            else
-                island[row][col] = '^';
+            counts[grid.index(col, row)] = map[row][col];
+            valid[grid.index(col, row)] = validMoves<Hood>(map, width, height, col, row);
         }
     }
 
-    //Print and color the 2D char array to console and outFile
-    printf("Polished Island:\n");
-    outFile << "Polished Island:" << endl;
-    for(int row = 0; row < height; row++) 
+    //--timelapse has the walk log every deposit
+    FrameRecorder* recorder = walk.monitor ? walk.monitor->recorder : 0;
+    if(recorder)
+        beginFrames(*recorder, grid);
+
+    //Lockstep lanes address cells with 32-bit offsets, larger grids keep the one-at-a-time walk
+    if(walk.walkers > 0 && grid.size < (1LL << 31))
     {
-        for(int col = 0; col < width; col++)
+        stats.walkers = walk.walkers;
+        stats.orderedWalkers = walk.orderedWalkers;
+        walkLockstep<Layout, Hood>(grid, counts.data(), valid.data(), width, height, sampler, windowX, windowY, radius, numParticles, maxLife, walk, stats);
+        numParticles = 0;
+    }
+
+    int dropX[DROP_BATCH_SIZE], dropY[DROP_BATCH_SIZE];
+    int batchPos = 0, batchSize = 0;
+
+    //Will loop until all particles have been dropped
+    while(numParticles != 0)
+    { 
+        //Refill the batch of drop positions once it has been used up
+        if(batchPos == batchSize)
         {
-            if(island[row][col] == '#')
+            batchSize = numParticles < DROP_BATCH_SIZE ? numParticles : DROP_BATCH_SIZE;
+            fillDropBatch(sampler, width, height, windowX, windowY, radius, dropX, dropY, batchSize);
+            batchPos = 0;
+        }
+        x = dropX[batchPos];
+        y = dropY[batchPos];
+        batchPos++;
+
+        long long cell = grid.index(x, y);
+        counts[cell]++; //Increment the initial particle dropped
+        if(recorder)
+            recorder->deposits.push_back(cell);
+        updateMoveMap<Layout, Hood>(grid, counts.data(), valid.data(), width, height, x, y);
+
+        //Loop through a particle's life until it dies
+        for(int i = maxLife; i > 0; i--)
+        {
+            //A particle standing on a dead end has no valid move and dies right away
+            unsigned int moves = valid[grid.index(x, y)];
+            if(moves == 0)
             {
-                cout  << on_blue << blue << '#' << reset; //Deep Water
-                outFile  << '#' << reset; 
+                stats.deadEndKills++;
+                break;
             }
-            else if(island[row][col] == '~')
+
+            //Picks one of the valid directions uniformly, which is what retrying random directions
+            //from the neighborhood until one of them is valid amounts to
+            int pick = rand() % __builtin_popcount(moves);
+            while(pick-- > 0)
+                moves &= moves - 1;
+            int direction = __builtin_ctz(moves);
+            x += DIR_X[direction];
+            y += DIR_Y[direction];
+            cell = grid.index(x, y);
+            counts[cell]++;
+            if(recorder)
+                recorder->deposits.push_back(cell);
+            stats.steps++;
+            updateMoveMap<Layout, Hood>(grid, counts.data(), valid.data(), width, height, x, y);
+        } // end of maxLife loop
+        numParticles--;
+        if(walk.monitor && !checkWalk(*walk.monitor, grid, counts.data()))
+            numParticles = 0;
+    } //end of numParticles loop
+
+    //The last frame is the finished map, whatever the frame interval
+    if(recorder && (recorder->offsets.empty() || !recorder->deposits.empty()))
+        recordFrame(*recorder, walk.monitor->dropped, counts.data());
+
+    //Copy the counts back row-major and collect the dead ends into a bitmap for --stats
+    stats.deadEnds.assign(((long long) width * height + 63) / 64, 0);
+    for(int row = 0; row < height; row++)
+    {
+        for(int col = 0; col < width; col++)
+        {
+            long long cell = (long long) row * width + col;
+            map[row][col] = counts[grid.index(col, row)];
+            if(valid[grid.index(col, row)] == 0)
             {
-                cout << on_cyan << cyan << '~' << reset; //Shallow Water
-                outFile << '~' << reset; 
+                stats.deadEnds[cell >> 6] |= 1ULL << (cell & 63);
+                stats.deadEndCells++;
             }
-            else if(island[row][col] == '.')
+        }
+    }
+} //End of walkParticles method
+
+//Method walkLockstep will walk walk.walkers particles at a time, advancing every lane by one step per round
+//Each particle gets its own random stream, seeded from rand() when it is dropped, so its choices do not depend on
+//the other lanes. The valid-direction lookups and direction picks of a round are done together (AVX2 gathers when the
+//CPU has them), then the moves are applied one lane at a time in lane order so deposits to the same cell are never lost.
+//Lanes read the grid as it was at the start of the round; with walk.orderedWalkers a lane next to a cell deposited
+//earlier in the same round re-picks its direction, which makes the result exactly that of stepping the particles
+//round-robin, and identical to the one-at-a-time walk for particles whose neighborhoods never overlap
+template<class Layout, class Hood>
+void walkLockstep(const Layout& grid, int* counts, unsigned char* valid, int width, int height, DropSampler& sampler, int windowX, int windowY, int radius, int numParticles, int maxLife, const WalkOptions& walk, RunStats& stats)
+{
+    int lanes = walk.walkers;
+    int laneX[MAX_WALKERS], laneY[MAX_WALKERS], laneLife[MAX_WALKERS], laneCell[MAX_WALKERS], laneDirection[MAX_WALKERS];
+    unsigned int laneState[MAX_WALKERS];
+    int movedX[MAX_WALKERS], movedY[MAX_WALKERS];
+    int active = 0;
+    for(int lane = 0; lane < lanes; lane++)
+    {
+        laneLife[lane] = 0;
+        laneCell[lane] = 0;
+        laneState[lane] = 1;
+    }
+#ifdef ISLAND_AVX2_KERNEL
+    bool useAvx2 = __builtin_cpu_supports("avx2");
+#endif
+    FrameRecorder* recorder = walk.monitor ? walk.monitor->recorder : 0;
+
+    int dropX[DROP_BATCH_SIZE], dropY[DROP_BATCH_SIZE];
+    int batchPos = 0, batchSize = 0;
+
+    while(true)
+    {
+        //Drop new particles into the idle lanes, in particle order
+        for(int lane = 0; lane < lanes && numParticles > 0; lane++)
+        {
+            if(laneLife[lane] > 0)
+                continue;
+            if(batchPos == batchSize)
             {
-                cout << on_yellow << white << '.' << reset; //Coast/Beach
-                outFile << '.' << reset; 
+                batchSize = numParticles < DROP_BATCH_SIZE ? numParticles : DROP_BATCH_SIZE;
+                fillDropBatch(sampler, width, height, windowX, windowY, radius, dropX, dropY, batchSize);
+                batchPos = 0;
             }
-            else if(island[row][col] == '-')
-            {
-                cout << on_bright_green << green << '-' << reset; //Plains/Grass
-                outFile << '-' << reset;
-            }    
-            else if(island[row][col] == '*')
+            laneX[lane] = dropX[batchPos];
+            laneY[lane] = dropY[batchPos];
+            batchPos++;
+            numParticles--;
+            long long cell = grid.index(laneX[lane], laneY[lane]);
+            counts[cell]++; //Increment the initial particle dropped
+            if(recorder)
+                recorder->deposits.push_back(cell);
+            updateMoveMap<Layout, Hood>(grid, counts, valid, width, height, laneX[lane], laneY[lane]);
+            laneState[lane] = (unsigned int) rand() * 2654435761u ^ 0x9E3779B9u;
+            if(laneState[lane] == 0)
+                laneState[lane] = 1;
+            laneLife[lane] = maxLife;
+            if(maxLife > 0)
+                active++;
+            if(walk.monitor && !checkWalk(*walk.monitor, grid, counts))
+                numParticles = 0; //particles already in a lane still finish their walk
+        }
+        if(active == 0)
+        {
+            if(numParticles == 0)
+                break;
+            continue;
+        }
+
+        //Look up every lane's valid directions and draw its direction for this round
+        for(int lane = 0; lane < lanes; lane++)
+            laneCell[lane] = laneLife[lane] > 0 ? (int) grid.index(laneX[lane], laneY[lane]) : 0;
+#ifdef ISLAND_AVX2_KERNEL
+        if(useAvx2)
+            stepLanesAvx2(valid, laneCell, laneState, laneDirection, lanes);
+        else
+#endif
+            stepLanes(valid, laneCell, laneState, laneDirection, lanes);
+
+        //Apply the moves one lane at a time
+        int moved = 0;
+        for(int lane = 0; lane < lanes; lane++)
+        {
+            if(laneLife[lane] == 0)
+                continue;
+            int x = laneX[lane], y = laneY[lane];
+            int direction = laneDirection[lane];
+            if(walk.orderedWalkers)
             {
-                cout <<  on_green << green << '*' << reset; //Forests
-                outFile << '*' << reset; 
-            }    
-            else if(island[row][col] == '^')
+                for(int other = 0; other < moved; other++)
+                {
+                    if(abs(movedX[other] - x) <= 1 && abs(movedY[other] - y) <= 1)
+                    {
+                        direction = pickDirection(valid[grid.index(x, y)], laneState[lane]);
+                        break;
+                    }
+                }
+            }
+
+            //A particle standing on a dead end has no valid move and dies right away
+            if(direction < 0)
             {
-                cout << on_bright_grey << white << '^' << reset; //Mountains
-                outFile << '^' << reset;
+                stats.deadEndKills++;
+                laneLife[lane] = 0;
+                active--;
+                continue;
             }
+            x += DIR_X[direction];
+            y += DIR_Y[direction];
+            long long cell = grid.index(x, y);
+            counts[cell]++;
+            if(recorder)
+                recorder->deposits.push_back(cell);
+            stats.steps++;
+            updateMoveMap<Layout, Hood>(grid, counts, valid, width, height, x, y);
+            laneX[lane] = x;
+            laneY[lane] = y;
+            movedX[moved] = x;
+            movedY[moved] = y;
+            moved++;
+            if(--laneLife[lane] == 0)
+                active--;
         }
-        cout << endl;
-        outFile << endl;
     }
+} //End of walkLockstep method
+
+//Method startMonitor will pick the cells a WalkMonitor samples, evenly spread over the map
+//Without --converge-every the map is checked about a hundred times over the walk
+void startMonitor(WalkMonitor& monitor, int width, int height, long long particles)
+{
+    if(monitor.every <= 0)
+        monitor.every = std::max(particles / 100, 1000LL);
+    monitor.total = particles;
+    monitor.dropped = 0;
+    monitor.untilCheck = monitor.every;
+    int columns = std::min(width, MONITOR_SAMPLES), rows = std::min(height, MONITOR_SAMPLES);
+    monitor.sampleX.resize(columns);
+    monitor.sampleY.resize(rows);
+    for(int i = 0; i < columns; i++)
+        monitor.sampleX[i] = (int) (((long long) 2 * i + 1) * width / (2 * columns));
+    for(int i = 0; i < rows; i++)
+        monitor.sampleY[i] = (int) (((long long) 2 * i + 1) * height / (2 * rows));
+    monitor.previous.clear();
+    monitor.delta = -1;
+    monitor.stopReason = 0;
+} //End of startMonitor method
 
-    //Delete 2D char array
-    for(int row = 0; row < height; row++) 
+//Method checkWalk will count a dropped particle and, every monitor.every of them, decide whether the walk goes on
+//Returns false once the shape delta is below the tolerance or the deadline has passed
+template<class Layout>
+bool checkWalk(WalkMonitor& monitor, const Layout& grid, const int* counts)
+{
+    monitor.dropped++;
+    if(monitor.recorder && --monitor.recorder->untilFrame == 0)
+    {
+        monitor.recorder->untilFrame = monitor.recorder->every;
+        recordFrame(*monitor.recorder, monitor.dropped, counts);
+    }
+    if(--monitor.untilCheck > 0)
+        return true;
+    monitor.untilCheck = monitor.every;
+    if(monitor.tolerance <= 0 && monitor.deadline <= 0)
+        return true;
+    if(monitor.deadline > 0 && secondsSince(monitor.start) >= monitor.deadline)
     {
-      delete[] island[row];
+        monitor.stopReason = "deadline";
+        return false;
     }
-    delete[] island;
+    if(monitor.tolerance <= 0)
+        return true;
 
-} //End of generateIsland method
+    //Scale the samples to 0 - 255 by their highest count and compare them with the last check
+    size_t samples = monitor.sampleX.size() * monitor.sampleY.size();
+    vector<double> current(samples);
+    int highest = 1;
+    size_t k = 0;
+    for(size_t row = 0; row < monitor.sampleY.size(); row++)
+    {
+        for(size_t col = 0; col < monitor.sampleX.size(); col++)
+        {
+            int count = counts[grid.index(monitor.sampleX[col], monitor.sampleY[row])];
+            current[k++] = count;
+            highest = std::max(highest, count);
+        }
+    }
+    double change = 0;
+    for(k = 0; k < samples; k++)
+    {
+        current[k] *= 255.0 / highest;
+        if(!monitor.previous.empty())
+            change += fabs(current[k] - monitor.previous[k]);
+    }
+    bool first = monitor.previous.empty();
+    monitor.previous.swap(current);
+    if(first)
+        return true;
+    monitor.delta = change / samples;
+    if(monitor.delta < monitor.tolerance)
+    {
+        monitor.stopReason = "converged";
+        return false;
+    }
+    return true;
+} //End of checkWalk method
 
-//Method printGrid will print out any 2D int arrays (Used for raw grid and normalized grid)
-void printGrid(int** map, int width, int height, ofstream& outFile)
+//Method startTimelapse will open a --timelapse file and write its header
+//Without --frame-every about a hundred frames are taken over the walk
+bool startTimelapse(FrameRecorder& recorder, const char* fileName, int width, int height, int layout, long long particles)
 {
-    for(int row = 0; row < height; row++)
+    recorder.file = fopen(fileName, "wb");
+    if(!recorder.file)
     {
-        for(int col = 0; col < width; col++)
+        printf("Error -- Could not write %s.\n", fileName);
+        return false;
+    }
+    setvbuf(recorder.file, 0, _IOFBF, 1 << 20);
+    if(recorder.every <= 0)
+        recorder.every = std::max(particles / 100, 1LL);
+    recorder.width = width;
+    recorder.height = height;
+    recorder.layout = layout;
+    recorder.untilFrame = recorder.every;
+    return true;
+} //End of startTimelapse method
+
+//Method beginFrames will size the recorder for the walk's layout and write the file header
+template<class Layout>
+void beginFrames(FrameRecorder& recorder, const Layout& grid)
+{
+    recorder.cells = grid.size;
+    recorder.deposits.reserve(1 << 16);
+    TimelapseHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "ISLT", 4);
+    header.version = 1;
+    header.width = recorder.width;
+    header.height = recorder.height;
+    header.every = recorder.every;
+    header.keyEvery = recorder.keyEvery;
+    header.layout = recorder.layout;
+    header.cells = grid.size;
+    fwrite(&header, sizeof(header), 1, recorder.file);
+    recorder.offset = sizeof(header);
+} //End of beginFrames method
+
+//Method recordFrame will append a frame of the walk's counts (in layout order) to the --timelapse file
+void recordFrame(FrameRecorder& recorder, long long particles, const int* counts)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bool key = recorder.offsets.size() % recorder.keyEvery == 0;
+    const void* payload = counts;
+    size_t used = recorder.cells * sizeof(int);
+    if(!key)
+    {
+        recorder.payload.resize(std::max(recorder.payload.size(), recorder.deposits.size() * 5));
+        unsigned char* out = recorder.payload.data();
+        long long previous = 0;
+        for(size_t k = 0; k < recorder.deposits.size(); k++)
         {
-            cout << setw(3) << map[row][col] << " ";
-            outFile << setw(3) << map[row][col] << " ";
+            long long step = (long long) recorder.deposits[k] - previous;
+            out = writeVarint(out, step < 0 ? ~((unsigned long long) step << 1) : (unsigned long long) step << 1);
+            previous = recorder.deposits[k];
         }
-        cout << endl;
-        outFile << endl;
+        payload = recorder.payload.data();
+        used = out - recorder.payload.data();
     }
-    cout << endl;
-    outFile << endl;
-} //End of printGrid method
+    recorder.deposits.clear();
+    TimelapseFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.key = key;
+    frame.particles = particles;
+    frame.bytes = used;
+    fwrite(&frame, sizeof(frame), 1, recorder.file);
+    fwrite(payload, 1, used, recorder.file);
+    recorder.offsets.push_back(recorder.offset);
+    recorder.offset += sizeof(frame) + used;
+    recorder.seconds += secondsSince(start);
+} //End of recordFrame method
 
-//Generate a random number between 0-1
-float frand()
+//Method writeVarint will store a number as LEB128 (7 bits per byte, low bits first, the top bit set on all but the
+//last) and return the byte after it
+unsigned char* writeVarint(unsigned char* out, unsigned long long value)
 {
-    return (float) (rand() % RAND_MAX) / (float) RAND_MAX;
-} //End of frand method
+    while(value >= 0x80)
+    {
+        *out++ = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (unsigned char) value;
+    return out;
+} //End of writeVarint method
+
+//Method readVarint will read a number written by writeVarint, stopping at end
+unsigned long long readVarint(const unsigned char*& next, const unsigned char* end)
+{
+    unsigned long long value = 0;
+    for(int shift = 0; next < end && shift < 64; shift += 7)
+    {
+        unsigned char byte = *next++;
+        value |= (unsigned long long) (byte & 0x7F) << shift;
+        if(byte < 0x80)
+            break;
+    }
+    return value;
+} //End of readVarint method
+
+//Method finishTimelapse will write the frame index and close the --timelapse file
+void finishTimelapse(FrameRecorder& recorder)
+{
+    TimelapseIndex index;
+    memset(&index, 0, sizeof(index));
+    index.frames = recorder.offsets.size();
+    memcpy(index.magic, "ISLTINDX", 8);
+    fwrite(recorder.offsets.data(), sizeof(unsigned long long), recorder.offsets.size(), recorder.file);
+    fwrite(&index, sizeof(index), 1, recorder.file);
+    if(fclose(recorder.file) != 0)
+        printf("Error -- Could not write the timelapse file.\n");
+    recorder.file = 0;
+} //End of finishTimelapse method
+
+//Method replayTimelapse will rebuild one frame of a --timelapse file and print it as the raw grid
+//It starts from the nearest keyframe at or before the frame and applies the delta frames after it
+bool replayTimelapse(const char* fileName, long long frame, OutputWriter& output)
+{
+    FILE* file = fopen(fileName, "rb");
+    TimelapseHeader header;
+    TimelapseIndex index;
+    bool ok = file && fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, "ISLT", 4) == 0
+           && header.version == 1 && header.width > 0 && header.height > 0
+           && fseek(file, -(long) sizeof(index), SEEK_END) == 0 && fread(&index, sizeof(index), 1, file) == 1
+           && memcmp(index.magic, "ISLTINDX", 8) == 0 && index.frames < (1ULL << 32);
+    vector<unsigned long long> offsets;
+    if(ok)
+    {
+        offsets.resize(index.frames);
+        ok = fseek(file, -(long) (sizeof(index) + offsets.size() * sizeof(unsigned long long)), SEEK_END) == 0
+          && fread(offsets.data(), sizeof(unsigned long long), offsets.size(), file) == offsets.size();
+    }
+    if(!ok)
+    {
+        printf("Error -- %s is not a timelapse file.\n", fileName);
+        if(file)
+            fclose(file);
+        return false;
+    }
+    if(frame >= (long long) offsets.size())
+    {
+        printf("Error -- %s has frames 0 - %lld.\n", fileName, (long long) offsets.size() - 1);
+        fclose(file);
+        return false;
+    }
+
+    int width = header.width, height = header.height;
+    long long first = frame - frame % header.keyEvery;
+    vector<long long> order;
+    if(header.layout == LAYOUT_TILE8)
+        layoutOrder<TileLayout<3> >(width, height, order);
+    else if(header.layout == LAYOUT_TILE16)
+        layoutOrder<TileLayout<4> >(width, height, order);
+    else if(header.layout == LAYOUT_MORTON)
+        layoutOrder<MortonLayout>(width, height, order);
+    else
+        layoutOrder<RowLayout>(width, height, order);
+    vector<int> counts(header.cells > 0 && header.cells < (1LL << 40) ? header.cells : 0, 0);
+    vector<unsigned char> payload;
+    TimelapseFrame current;
+    memset(&current, 0, sizeof(current));
+    for(long long k = first; ok && k <= frame; k++)
+    {
+        ok = fseek(file, (long) offsets[k], SEEK_SET) == 0 && fread(&current, sizeof(current), 1, file) == 1
+          && current.bytes < (1ULL << 40);
+        if(ok)
+        {
+            payload.resize(current.bytes);
+            ok = fread(payload.data(), 1, payload.size(), file) == payload.size();
+        }
+        if(current.key)
+        {
+            if(ok && payload.size() == counts.size() * sizeof(int))
+                memcpy(counts.data(), payload.data(), payload.size());
+            continue;
+        }
+        const unsigned char* next = payload.data();
+        const unsigned char* end = next + payload.size();
+        long long cell = 0;
+        while(next < end)
+        {
+            unsigned long long step = readVarint(next, end);
+            cell += (step & 1) ? ~(long long) (step >> 1) : (long long) (step >> 1);
+            if(cell >= 0 && cell < (long long) counts.size())
+                counts[cell]++;
+        }
+    }
+    fclose(file);
+    if(!ok)
+    {
+        printf("Error -- %s is truncated.\n", fileName);
+        return false;
+    }
+
+    vector<int> grid((size_t) width * height);
+    vector<int*> rows(height);
+    for(size_t cell = 0; cell < grid.size(); cell++)
+        grid[cell] = order[cell] < (long long) counts.size() ? counts[order[cell]] : 0;
+    for(int row = 0; row < height; row++)
+        rows[row] = &grid[(size_t) row * width];
+    output.print(OUTPUT_CONSOLE, "\nFrame %lld of %lld, %lld particles\n", frame, (long long) offsets.size() - 1, current.particles);
+    output.print(OUTPUT_BOTH, "Raw Grid:\n");
+    printGrid(rows.data(), width, height, output);
+    return true;
+} //End of replayTimelapse method
+
+//Method layoutOrder will list the layout index of every cell, row-major
+template<class Layout>
+void layoutOrder(int width, int height, vector<long long>& order)
+{
+    Layout grid(width, height);
+    order.resize((size_t) width * height);
+    for(int row = 0; row < height; row++)
+    {
+        for(int col = 0; col < width; col++)
+            order[(size_t) row * width + col] = grid.index(col, row);
+    }
+} //End of layoutOrder method
+
+//Method walkerRandom will advance a lockstep walker's xorshift32 random stream
+unsigned int walkerRandom(unsigned int state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+} //End of walkerRandom method
+
+//Method pickDirection will turn valid-direction bits and a random number into one of the valid directions
+//The high 16 bits of the random number scale to the number of valid directions; -1 means a dead end
+int pickDirection(unsigned int moves, unsigned int random)
+{
+    int pick = ((random >> 16) * PICK.popcount[moves]) >> 16;
+    return PICK.direction[moves * 8 + pick];
+} //End of pickDirection method
+
+//Method stepLanes will advance the random stream of every lane and pick its direction from the cell it stands on
+void stepLanes(const unsigned char* valid, const int* cell, unsigned int* state, int* direction, int lanes)
+{
+    for(int lane = 0; lane < lanes; lane++)
+    {
+        state[lane] = walkerRandom(state[lane]);
+        direction[lane] = pickDirection(valid[cell[lane]], state[lane]);
+    }
+} //End of stepLanes method
+
+#ifdef ISLAND_AVX2_KERNEL
+//Method stepLanesAvx2 is stepLanes for eight lanes per iteration, gathering the valid-direction bytes and table
+//entries so the independent loads of all lanes are in flight together
+__attribute__((target("avx2")))
+void stepLanesAvx2(const unsigned char* valid, const int* cell, unsigned int* state, int* direction, int lanes)
+{
+    const __m256i byteMask = _mm256_set1_epi32(0xFF);
+    for(int lane = 0; lane < lanes; lane += 8)
+    {
+        __m256i index = _mm256_loadu_si256((const __m256i*) (cell + lane));
+        __m256i moves = _mm256_and_si256(_mm256_i32gather_epi32((const int*) valid, index, 1), byteMask);
+
+        __m256i random = _mm256_loadu_si256((const __m256i*) (state + lane));
+        random = _mm256_xor_si256(random, _mm256_slli_epi32(random, 13));
+        random = _mm256_xor_si256(random, _mm256_srli_epi32(random, 17));
+        random = _mm256_xor_si256(random, _mm256_slli_epi32(random, 5));
+        _mm256_storeu_si256((__m256i*) (state + lane), random);
+
+        __m256i count = _mm256_i32gather_epi32(PICK.popcount, moves, 4);
+        __m256i pick = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(random, 16), count), 16);
+        __m256i slot = _mm256_add_epi32(_mm256_slli_epi32(moves, 3), pick);
+        _mm256_storeu_si256((__m256i*) (direction + lane), _mm256_i32gather_epi32(PICK.direction, slot, 4));
+    }
+} //End of stepLanesAvx2 method
+#endif
+
+//Method normalizeMap will use the largest number and normalize all elements in the 2D int array to 255
+//histogram gets the number of cells at each normalized value, counted per band of rows and summed at the end
+int** normalizeMap(int** norMap, int width, int height, int threads, long long histogram[256], MapArchive* archive, MapPyramid* pyramid, OutputWriter& output)
+{
+    int maxVal = findMax(norMap, width, height);
+    if(maxVal <= 0)
+        maxVal = 1; //An empty map stays all 0 instead of dividing by zero
+    int bands = threads < height ? threads : height;
+    vector<long long> bandHistograms((size_t) bands * 256, 0);
+    parallelBands(height, bands, [&](int band, int firstRow, int endRow)
+    {
+        long long* counts = &bandHistograms[(size_t) band * 256];
+        for(int row = firstRow; row < endRow; row++)
+        {
+            for(int col = 0; col < width; col++)
+            {
+                int value = ((double) norMap[row][col] / maxVal) * 255; //This will normalize a coordinate to 255
+                norMap[row][col] = value;
+                counts[value]++;
+            }
+            if(pyramid)
+            {
+                unsigned char* base = &pyramid->levels[0].maxHeight[(size_t) row * width];
+                for(int col = 0; col < width; col++)
+                    base[col] = norMap[row][col];
+            }
+        }
+    });
+    for(int value = 0; value < 256; value++)
+    {
+        histogram[value] = 0;
+        for(int band = 0; band < bands; band++)
+            histogram[value] += bandHistograms[(size_t) band * 256 + value];
+    }
+
+    //Compress the rows in order when --compress is on
+    for(int row = 0; archive && row < height; row++)
+        encodeNormalizedRow(*archive, norMap[row]);
+
+    //Print the normalized grid to the console and island.txt
+    output.print(OUTPUT_BOTH, "Normalized Grid:\n");
+    printGrid(norMap, width, height, output);
+    return norMap;
+} //End of normalizeMap method
+
+//Method chooseWaterLine will pick the waterline whose land (cells above it) comes closest to landFraction of the map
+//Any waterline from 0 to 254 can be picked, the lowest one wins a tie
+int chooseWaterLine(const long long histogram[256], long long cells, double landFraction)
+{
+    long long land = cells - histogram[0];
+    int best = 0;
+    double bestError = fabs((double) land / cells - landFraction);
+    for(int waterLine = 1; waterLine < 255; waterLine++)
+    {
+        land -= histogram[waterLine];
+        double error = fabs((double) land / cells - landFraction);
+        if(error < bestError)
+        {
+            best = waterLine;
+            bestError = error;
+        }
+    }
+    return best;
+} //End of chooseWaterLine method
+
+//Method smoothMap will blur the raw particle counts and/or run thermal erosion on them, in place
+//The blur is separable: a horizontal pass over each row into a scratch plane, then a vertical pass that builds each
+//output row from the 2 * radius + 1 scratch rows around it, one block of columns at a time. Edges repeat the border
+//cell. Box weights are all 1 and gauss weights are the binomial coefficients C(2 * radius, k), and each pass rounds
+//back to whole counts, so the result is exact integer math and identical for any number of threads
+//Each erosion pass moves an eighth of every height drop steeper than the talus (4/255 of the highest count) from a
+//cell to its lower 4-neighbor. All moves are computed from the previous pass, so bands can run in any order
+void smoothMap(int** map, int width, int height, const SmoothOptions& smooth, int threads)
+{
+    vector<int> scratch((size_t) width * height);
+    if(smooth.kernel != SMOOTH_NONE)
+    {
+        int radius = smooth.radius;
+        int taps = 2 * radius + 1;
+        vector<long long> weights(taps, 1);
+        for(int k = 1; smooth.kernel == SMOOTH_GAUSS && k < taps; k++)
+            weights[k] = weights[k - 1] * (taps - k) / k;
+        long long total = 0;
+        for(int k = 0; k < taps; k++)
+            total += weights[k];
+
+        //Horizontal pass: pad the row with its border cells, then add the taps one shifted row at a time
+        parallelBands(height, threads, [&](int, int firstRow, int endRow)
+        {
+            vector<int> padded(width + 2 * radius);
+            vector<long long> sums(width);
+            for(int row = firstRow; row < endRow; row++)
+            {
+                for(int col = -radius; col < width + radius; col++)
+                    padded[col + radius] = map[row][std::min(std::max(col, 0), width - 1)];
+                std::fill(sums.begin(), sums.end(), 0);
+                for(int k = 0; k < taps; k++)
+                {
+                    const int* shifted = &padded[k];
+                    long long weight = weights[k];
+                    for(int col = 0; col < width; col++)
+                        sums[col] += weight * shifted[col];
+                }
+                int* out = &scratch[(size_t) row * width];
+                for(int col = 0; col < width; col++)
+                    out[col] = (int) ((sums[col] + total / 2) / total);
+            }
+        });
+
+        //Vertical pass: the taps of an output row are whole scratch rows, streamed a column block at a time
+        parallelBands(height, threads, [&](int, int firstRow, int endRow)
+        {
+            long long sums[SMOOTH_BLOCK];
+            for(int row = firstRow; row < endRow; row++)
+            {
+                for(int firstCol = 0; firstCol < width; firstCol += SMOOTH_BLOCK)
+                {
+                    int count = std::min(SMOOTH_BLOCK, width - firstCol);
+                    std::fill(sums, sums + count, 0);
+                    for(int k = 0; k < taps; k++)
+                    {
+                        int tapRow = std::min(std::max(row - radius + k, 0), height - 1);
+                        const int* in = &scratch[(size_t) tapRow * width + firstCol];
+                        long long weight = weights[k];
+                        for(int col = 0; col < count; col++)
+                            sums[col] += weight * in[col];
+                    }
+                    int* out = map[row] + firstCol;
+                    for(int col = 0; col < count; col++)
+                        out[col] = (int) ((sums[col] + total / 2) / total);
+                }
+            }
+        });
+    }
+
+    if(smooth.erodeIterations > 0)
+    {
+        int talus = std::max(1, (int) ((long long) findMax(map, width, height) * 4 / 255));
+        vector<int*> source(height), target(height);
+        for(int row = 0; row < height; row++)
+        {
+            source[row] = map[row];
+            target[row] = &scratch[(size_t) row * width];
+        }
+        for(int pass = 0; pass < smooth.erodeIterations; pass++)
+        {
+            parallelBands(height, threads, [&](int, int firstRow, int endRow)
+            {
+                for(int row = firstRow; row < endRow; row++)
+                {
+                    //A missing neighbor is the cell itself, which never exchanges anything
+                    const int* here = source[row];
+                    const int* up = source[row > 0 ? row - 1 : row];
+                    const int* down = source[row < height - 1 ? row + 1 : row];
+                    int* out = target[row];
+                    if(width == 1)
+                    {
+                        out[0] = erodeCell(here[0], here[0], here[0], up[0], down[0], talus);
+                        continue;
+                    }
+                    out[0] = erodeCell(here[0], here[0], here[1], up[0], down[0], talus);
+                    for(int col = 1; col < width - 1; col++)
+                        out[col] = erodeCell(here[col], here[col - 1], here[col + 1], up[col], down[col], talus);
+                    out[width - 1] = erodeCell(here[width - 1], here[width - 2], here[width - 1], up[width - 1], down[width - 1], talus);
+                }
+            });
+            source.swap(target);
+        }
+        if(source[0] != map[0])
+        {
+            for(int row = 0; row < height; row++)
+                memcpy(map[row], source[row], width * sizeof(int));
+        }
+    }
+} //End of smoothMap method
+
+//Method erodeCell will return a cell's height after one erosion pass: it loses an eighth of every drop past the
+//talus towards a lower neighbor and gains the same from every higher neighbor, so the total is conserved
+int erodeCell(int here, int left, int right, int up, int down, int talus)
+{
+    int gained = std::max(left - here - talus, 0) / 8 + std::max(right - here - talus, 0) / 8
+               + std::max(up - here - talus, 0) / 8 + std::max(down - here - talus, 0) / 8;
+    int lost = std::max(here - left - talus, 0) / 8 + std::max(here - right - talus, 0) / 8
+             + std::max(here - up - talus, 0) / 8 + std::max(here - down - talus, 0) / 8;
+    return here + gained - lost;
+} //End of erodeCell method
+
+//Method buildDropSampler will build the alias table for the drop zone clipped to the grid
+//Each cell is weighted by the area of the disk that the polar sampler maps onto it, so the draws follow the same
+//distribution as the old rejection loop. Returns false (leaving the table empty) when the disk is too large to tabulate
+bool buildDropSampler(DropSampler& sampler, int width, int height, int windowX, int windowY, int radius)
+{
+    //Bounding box of the disk clipped to the grid
+    int minX = windowX - radius < 0 ? 0 : windowX - radius;
+    int maxX = windowX + radius > width - 1 ? width - 1 : windowX + radius;
+    int minY = windowY - radius < 0 ? 0 : windowY - radius;
+    int maxY = windowY + radius > height - 1 ? height - 1 : windowY + radius;
+    if((long long) (maxX - minX + 1) * (maxY - minY + 1) > ALIAS_CELL_LIMIT)
+        return false;
+
+    //Collect every cell with a non-zero share of the disk
+    //Coordinates are truncated toward zero, so cell 0 receives everything from -1 to 1 on its axis
+    vector<double> weight;
+    double total = 0;
+    for(int row = minY; row <= maxY; row++)
+    {
+        double y0 = row == 0 ? -1 : row;
+        for(int col = minX; col <= maxX; col++)
+        {
+            double x0 = col == 0 ? -1 : col;
+            double area = dropCellArea(x0, col + 1, y0, row + 1, windowX, windowY, radius);
+            if(area > 0)
+            {
+                sampler.cell.push_back((unsigned int) row * width + col);
+                weight.push_back(area);
+                total += area;
+            }
+        }
+    }
+
+    //Vose's alias method: split the scaled weights into under-full and over-full slots and pair them up
+    int count = (int) weight.size();
+    sampler.alias.assign(count, 0);
+    sampler.threshold.assign(count, 0);
+    vector<int> small, large;
+    for(int i = 0; i < count; i++)
+    {
+        weight[i] = weight[i] * count / total;
+        if(weight[i] < 1.0)
+            small.push_back(i);
+        else
+            large.push_back(i);
+    }
+    while(!small.empty() && !large.empty())
+    {
+        int s = small.back(), l = large.back();
+        small.pop_back();
+        sampler.threshold[s] = (unsigned int) (weight[s] * ((double) RAND_MAX + 1));
+        sampler.alias[s] = sampler.cell[l];
+        weight[l] -= 1.0 - weight[s];
+        if(weight[l] < 1.0)
+        {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    //Whatever is left over is full up to rounding error and always keeps its own cell
+    for(int i = 0; i < (int) small.size(); i++)
+    {
+        sampler.threshold[small[i]] = (unsigned int) RAND_MAX + 1u;
+        sampler.alias[small[i]] = sampler.cell[small[i]];
+    }
+    for(int i = 0; i < (int) large.size(); i++)
+    {
+        sampler.threshold[large[i]] = (unsigned int) RAND_MAX + 1u;
+        sampler.alias[large[i]] = sampler.cell[large[i]];
+    }
+    return true;
+} //End of buildDropSampler method
+
+//Method dropZoneOnGrid will tell whether the drop-zone disk covers any of the grid
+//Coordinates are truncated toward zero, so the cells span -1 to width and -1 to height; the disk reaches them exactly
+//when buildDropSampler would give some cell a non-zero area
+bool dropZoneOnGrid(int width, int height, int windowX, int windowY, int radius)
+{
+    double dx = windowX < -1 ? -1.0 - windowX : windowX > width ? (double) windowX - width : 0;
+    double dy = windowY < -1 ? -1.0 - windowY : windowY > height ? (double) windowY - height : 0;
+    return width > 0 && height > 0 && dx * dx + dy * dy < (double) radius * radius;
+} //End of dropZoneOnGrid method
+
+//Method uniformDropSampler will build an alias table that draws each of the given cells equally often
+void uniformDropSampler(DropSampler& sampler, const vector<unsigned int>& cells)
+{
+    sampler.cell = cells;
+    sampler.alias = cells;
+    sampler.threshold.assign(cells.size(), (unsigned int) RAND_MAX + 1u);
+} //End of uniformDropSampler method
+
+//Method dropCellArea will return the area of the rectangle [x0,x1]x[y0,y1] that lies inside the drop-zone disk
+double dropCellArea(double x0, double x1, double y0, double y1, int windowX, int windowY, int radius)
+{
+    double r2 = (double) radius * radius;
+
+    //Nearest and farthest corners decide whether the rectangle is fully outside or fully inside
+    double nearX = windowX < x0 ? x0 - windowX : (windowX > x1 ? windowX - x1 : 0);
+    double nearY = windowY < y0 ? y0 - windowY : (windowY > y1 ? windowY - y1 : 0);
+    if(nearX * nearX + nearY * nearY >= r2)
+        return 0;
+    double farX = fabs(x0 - windowX) > fabs(x1 - windowX) ? x0 - windowX : x1 - windowX;
+    double farY = fabs(y0 - windowY) > fabs(y1 - windowY) ? y0 - windowY : y1 - windowY;
+    if(farX * farX + farY * farY <= r2)
+        return (x1 - x0) * (y1 - y0);
+
+    //Cells on the rim integrate the clipped chord length across x (midpoint rule, exact in y)
+    const int steps = 64;
+    double dx = (x1 - x0) / steps, area = 0;
+    for(int i = 0; i < steps; i++)
+    {
+        double px = x0 + (i + 0.5) * dx - windowX;
+        if(px * px >= r2)
+            continue;
+        double half = sqrt(r2 - px * px);
+        double top = windowY + half < y1 ? windowY + half : y1;
+        double bottom = windowY - half > y0 ? windowY - half : y0;
+        if(top > bottom)
+            area += (top - bottom) * dx;
+    }
+    return area;
+} //End of dropCellArea method
+
+//Method fillDropBatch will draw the next count drop positions into dropX/dropY
+//Uses the alias table when it was built and the original polar rejection loop otherwise. A table with more slots than
+//rand() has values (past 32768 where RAND_MAX is 32767, as with MSVC and MinGW) picks its slot from two draws, so
+//every slot can come up; smaller tables keep the single draw, and the islands of existing seeds with it
+void fillDropBatch(DropSampler& sampler, int width, int height, int windowX, int windowY, int radius, int* dropX, int* dropY, int count)
+{
+    int slots = (int) sampler.cell.size();
+    if(slots > 0)
+    {
+        bool wide = (unsigned long long) slots > (unsigned long long) RAND_MAX;
+        for(int i = 0; i < count; i++)
+        {
+            int slot;
+            if(wide)
+            {
+                unsigned long long draw = (unsigned long long) rand() * ((unsigned long long) RAND_MAX + 1);
+                slot = (int) ((draw + rand()) % slots);
+            }
+            else
+                slot = rand() % slots;
+            unsigned int index = (unsigned int) rand() < sampler.threshold[slot] ? sampler.cell[slot] : sampler.alias[slot];
+            dropX[i] = index % width;
+            dropY[i] = index / width;
+        }
+        return;
+    }
+
+    double r, theta;
+    const double PI = 3.1415926535897;
+    for(int i = 0; i < count; i++)
+    {
+        //Will loop over and over again if x or y is out of bounds of the 2D array until the coordinate is inside the bounds
+        do
+        {
+            r = radius * sqrt(frand());
+            theta = frand() * 2 * PI;
+            dropX[i] = (int) (windowX + r * cos(theta));
+            dropY[i] = (int) (windowY + r * sin(theta));
+        } while (dropX[i] >= width || dropX[i] < 0 || dropY[i] >= height || dropY[i] < 0);
+    }
+} //End of fillDropBatch method
+
+//Method validMoves will return the valid-direction bits of a coordinate, checking every neighbor in Hood with moveExists
+template<class Hood>
+unsigned char validMoves(int** map, int width, int height, int x, int y)
+{
+    unsigned char valid = 0;
+    for(int k = 0; k < Hood::count; k++)
+    {
+        int direction = Hood::directions[y & 1][k];
+        if(moveExists(map, width, height, x, y, x + DIR_X[direction], y + DIR_Y[direction]))
+            valid |= 1 << direction;
+    }
+    return valid;
+} //End of validMoves method
+
+//Method updateMoveMap will refresh the valid-direction bits around a cell that was just incremented
+//The cell gets all of its bits recomputed and each neighbor only re-checks its bit pointing back at the cell
+//The loop runs over Hood's constant direction table, so each neighborhood unrolls into straight-line code
+template<class Layout, class Hood>
+void updateMoveMap(const Layout& grid, const int* counts, unsigned char* valid, int width, int height, int x, int y)
+{
+    long long center = grid.index(x, y);
+    int level = counts[center];
+    unsigned int own = 0;
+    bool interior = x > 0 && x < width - 1 && y > 0 && y < height - 1;
+    const int* directions = Hood::directions[y & 1];
+    for(int k = 0; k < Hood::count; k++)
+    {
+        int direction = directions[k];
+        int col = x + DIR_X[direction], row = y + DIR_Y[direction];
+        if(!interior && (col < 0 || col >= width || row < 0 || row >= height))
+            continue;
+        long long cell = grid.index(col, row);
+        int neighbor = counts[cell];
+        int opposite = (direction + 4) & 7;
+        own |= (unsigned int) (neighbor <= level) << direction;
+        valid[cell] = (valid[cell] & ~(1 << opposite)) | ((level <= neighbor) << opposite);
+    }
+    valid[center] = own;
+} //End of updateMoveMap method
+
+//Method writeDeadEndMap will write the dead-end bitmap as a binary PBM image (black = cell with no valid move)
+void writeDeadEndMap(const vector<unsigned long long>& bits, int width, int height, const char* fileName)
+{
+    if(bits.empty())
+        return;
+    ofstream pbm(fileName, std::ios::binary);
+    pbm << "P4\n" << width << " " << height << "\n";
+    vector<unsigned char> line((width + 7) / 8);
+    for(int row = 0; row < height; row++)
+    {
+        std::fill(line.begin(), line.end(), 0);
+        for(int col = 0; col < width; col++)
+        {
+            long long cell = (long long) row * width + col;
+            if((bits[cell >> 6] >> (cell & 63)) & 1)
+                line[col >> 3] |= 0x80 >> (col & 7);
+        }
+        pbm.write((const char*) line.data(), line.size());
+    }
+} //End of writeDeadEndMap method
+
+//Method printStats will print the simulation counters and stage timings collected during the run
+void printStats(const RunStats& stats, int width, int height)
+{
+    long long cells = (long long) width * height;
+    printf("\nStats:\n");
+    printf("  Particles dropped:     %lld\n", stats.particles);
+    if(stats.stopReason)
+        printf("  Early stop:            %s after %lld of %lld particles (about %.3f s saved)\n", stats.stopReason,
+               stats.particles, stats.particlesAsked, stats.savedSeconds);
+    else if(stats.particles < stats.particlesAsked)
+        printf("  Early stop:            converged after %lld of %lld particles (cached)\n", stats.particles, stats.particlesAsked);
+    if(stats.timelapseFrames > 0)
+        printf("  Timelapse:             %lld frames, %.1f MB, %.3f s recording (%.1f%% of the walk)\n", stats.timelapseFrames,
+               stats.timelapseBytes / 1048576.0, stats.timelapseSeconds,
+               stats.simulateSeconds > 0 ? 100.0 * stats.timelapseSeconds / stats.simulateSeconds : 0.0);
+    if(stats.shapeDelta >= 0)
+        printf("  Shape delta:           %.3f at the last check\n", stats.shapeDelta);
+    printf("  Steps walked:          %lld\n", stats.steps);
+    printf("  Dead-end kills:        %lld (%.1f%% of particles)\n", stats.deadEndKills,
+           stats.particles > 0 ? 100.0 * stats.deadEndKills / stats.particles : 0.0);
+    if(stats.deadEndCells < 0)
+        printf("  Dead-end cells:        n/a (the preview walked a smaller grid, --refine finds them)\n");
+    else
+        printf("  Dead-end cells:        %lld of %lld (%.1f%%%s)\n", stats.deadEndCells, cells,
+               cells > 0 ? 100.0 * stats.deadEndCells / cells : 0.0, stats.deadEnds.empty() ? "" : ", bitmap in island_deadends.pbm");
+    printf("  Simulation:            %.3f s (%.2f M steps/s, %s layout, %s neighborhood)\n", stats.simulateSeconds,
+           stats.simulateSeconds > 0 ? stats.steps / stats.simulateSeconds / 1e6 : 0.0, stats.layout, stats.neighborhood);
+    if(stats.cache)
+        printf("  Result cache:          %s%s\n", stats.cache, strcmp(stats.cache, "hit") == 0 ? " (simulation skipped)" : "");
+    if(stats.shards > 0)
+        printf("  Shards:                %d processes, %d restarted, walks of %.3f - %.3f s, %.3f s to merge\n", stats.shards,
+               stats.shardRetries, stats.fastestShard, stats.slowestShard, stats.mergeSeconds);
+    if(stats.walkers > 0)
+        printf("  Lockstep walkers:      %d%s\n", stats.walkers, stats.orderedWalkers ? " (ordered)" : "");
+    printf("  Stage makeParticleMap: %.3f s\n", stats.particleMapSeconds);
+    if(stats.smoothSeconds >= 0)
+        printf("  Stage smoothMap:       %.3f s (%d threads, %.1f M cells/s)\n", stats.smoothSeconds, stats.threads,
+               stats.smoothSeconds > 0 ? cells / stats.smoothSeconds / 1e6 : 0.0);
+    if(stats.fusedSeconds >= 0)
+        printf("  Stage fusedPipeline:   %.3f s (%d threads, %.1f M cells/s)\n", stats.fusedSeconds, stats.threads,
+               stats.fusedSeconds > 0 ? cells / stats.fusedSeconds / 1e6 : 0.0);
+    else
+    {
+        printf("  Stage normalizeMap:    %.3f s\n", stats.normalizeSeconds);
+        printf("  Stage generateIsland:  %.3f s\n", stats.islandSeconds);
+    }
+    if(stats.formatBytes > 0)
+        printf("  Text formatting:       %.1f MB in %.3f s (%d threads, %.1f MB/s)\n", stats.formatBytes / 1048576.0,
+               stats.formatSeconds, stats.threads, stats.formatSeconds > 0 ? stats.formatBytes / 1048576.0 / stats.formatSeconds : 0.0);
+    if(stats.analyzeSeconds >= 0)
+        printf("  Stage labelComponents: %.3f s (%d threads, %.1f M cells/s)\n", stats.analyzeSeconds, stats.threads,
+               stats.analyzeSeconds > 0 ? cells / stats.analyzeSeconds / 1e6 : 0.0);
+    if(stats.distanceSeconds >= 0)
+        printf("  Stage distanceToCoast: %.3f s (%d threads, %.1f M cells/s)\n", stats.distanceSeconds, stats.threads,
+               stats.distanceSeconds > 0 ? cells / stats.distanceSeconds / 1e6 : 0.0);
+    if(stats.counters.on)
+        printCounters(stats.counters);
+} //End of printStats method
+
+//Method runCheck will run every CHECK_CASES entry without output and compare its planes with the golden hashes
+//A case's throughput in M steps/s is the median of CHECK_RUNS samples, each at least CHECK_SAMPLE_SECONDS of repeated
+//walks so timer resolution and scheduling hiccups wash out, after a warmup sample that also sets how many walks a
+//sample takes. With no baseline file yet, the throughputs are written to it; otherwise a case more than tolerance
+//percent below its baseline fails, or only gets a warning without perfGate (--no-perf-gate, for machines too noisy
+//to time on). Returns true when every case passed
+bool runCheck(const char* baselineFile, double tolerance, bool perfGate, int threads)
+{
+    int cases = sizeof(CHECK_CASES) / sizeof(CHECK_CASES[0]);
+    vector<double> baseline(cases, 0);
+    FILE* stored = fopen(baselineFile, "r");
+    if(stored)
+    {
+        char line[256];
+        while(fgets(line, sizeof(line), stored))
+        {
+            //Each line is a throughput and the case name
+            double throughput;
+            int length = 0;
+            if(sscanf(line, "%lf %n", &throughput, &length) < 1)
+                continue;
+            line[strcspn(line, "\n")] = 0;
+            for(int k = 0; k < cases; k++)
+            {
+                if(strcmp(line + length, CHECK_CASES[k].name) == 0)
+                    baseline[k] = throughput;
+            }
+        }
+        fclose(stored);
+    }
+
+    printf("Checking %d cases against their golden hashes%s\n", cases, stored ? "" : " (no throughput baseline yet)");
+    OutputWriter muted(0);
+    vector<double> throughputs(cases, 0);
+    int failures = 0, slowCases = 0;
+    int checks = cases;           //the CHECK_CASES and the checks after them
+    for(int k = 0; k < cases; k++)
+    {
+        const CheckCase& test = CHECK_CASES[k];
+        int width = test.width, height = test.height;
+        size_t cells = (size_t) width * height;
+        TerrainPalette palette;
+        if(test.terrain == TERRAIN_HIGHLANDS)
+            schemePalette<HighlandsTerrain>(palette);
+        else if(test.terrain == TERRAIN_LOWLANDS)
+            schemePalette<LowlandsTerrain>(palette);
+        else
+            schemePalette<ClassicTerrain>(palette);
+        compilePalette(palette);
+        WalkOptions walk;
+        walk.layout = test.layout;
+        walk.neighborhood = test.neighborhood;
+        walk.walkers = test.walkers;
+        walk.orderedWalkers = test.orderedWalkers;
+        SmoothOptions smooth;
+        smooth.kernel = test.kernel;
+        smooth.erodeIterations = test.erodeIterations;
+
+        //Walk the case again and again, every walk must give the same counts
+        vector<int> plane(cells), first;
+        vector<int*> rows(height);
+        for(int row = 0; row < height; row++)
+            rows[row] = &plane[(size_t) row * width];
+        bool repeatable = true;
+        long long steps = 0;
+        double seconds = 0;
+        auto walkCase = [&]()
+        {
+            std::fill(plane.begin(), plane.end(), 0);
+            RunStats stats;
+            srand(test.seed);
+            makeParticleMap(rows.data(), width, height, test.windowX, test.windowY, test.radius, test.particles, test.maxLife, walk, muted, stats);
+            steps += stats.steps;
+            seconds += stats.simulateSeconds;
+            if(first.empty())
+                first = plane;
+            else
+                repeatable = repeatable && plane == first;
+        };
+        int walksPerSample = 0;
+        while(seconds < CHECK_SAMPLE_SECONDS && walksPerSample < 1000)
+        {
+            walkCase();
+            walksPerSample++;
+        }
+        double samples[CHECK_RUNS];
+        for(int run = 0; run < CHECK_RUNS; run++)
+        {
+            steps = 0;
+            seconds = 0;
+            for(int walkIndex = 0; walkIndex < walksPerSample; walkIndex++)
+                walkCase();
+            samples[run] = seconds > 0 ? steps / seconds / 1e6 : 0;
+        }
+        std::sort(samples, samples + CHECK_RUNS);
+        throughputs[k] = samples[CHECK_RUNS / 2];
+        double spread = throughputs[k] > 0 ? 100.0 * (samples[CHECK_RUNS - 1] - samples[0]) / throughputs[k] : 0;
+        unsigned long long raw = hashBytes(plane.data(), cells * sizeof(int), 14695981039346656037ULL);
+
+        //Then the rest of the pipeline, as main runs it
+        if(smooth.kernel != SMOOTH_NONE || smooth.erodeIterations > 0)
+            smoothMap(rows.data(), width, height, smooth, threads);
+        long long histogram[256];
+        normalizeMap(rows.data(), width, height, threads, histogram, 0, 0, muted);
+        int waterLine = test.landFraction < 0 ? test.waterLine : chooseWaterLine(histogram, (long long) cells, test.landFraction);
+        vector<unsigned char> heights(cells);
+        for(size_t cell = 0; cell < cells; cell++)
+            heights[cell] = plane[cell];
+        vector<char> terrain(cells);
+        vector<char*> terrainRows(height);
+        for(int row = 0; row < height; row++)
+            terrainRows[row] = &terrain[(size_t) row * width];
+        classifyTerrain(palette, rows.data(), terrainRows.data(), width, height, waterLine);
+        unsigned long long normalized = hashBytes(heights.data(), cells, 14695981039346656037ULL);
+        unsigned long long island = hashBytes(terrain.data(), cells, 14695981039346656037ULL);
+
+        bool matches = raw == test.raw && normalized == test.normalized && island == test.terrainHash;
+        bool slow = baseline[k] > 0 && throughputs[k] < baseline[k] * (1 - tolerance / 100);
+        printf("  %-24s %s  %7.2f M steps/s, %5.1f%% spread", test.name, !(matches && repeatable) || (slow && perfGate) ? "FAIL" : slow ? "slow" : "ok  ", throughputs[k], spread);
+        if(baseline[k] > 0)
+            printf(" (baseline %.2f, %+.1f%%)", baseline[k], 100.0 * (throughputs[k] / baseline[k] - 1));
+        printf("\n");
+        if(!repeatable)
+            printf("    the same seed walked to different counts\n");
+        if(!matches)
+            printf("    hashes 0x%016llxULL, 0x%016llxULL, 0x%016llxULL; golden 0x%016llxULL, 0x%016llxULL, 0x%016llxULL\n",
+                   raw, normalized, island, test.raw, test.normalized, test.terrainHash);
+        if(slow)
+            printf("    %smore than %g%% slower than the baseline\n", perfGate ? "" : "warning: ", tolerance);
+        failures += !(matches && repeatable) || (slow && perfGate);
+        slowCases += slow;
+    }
+
+    //--preview --stats: the dead ends reported must be the full map's (found by --refine) or none, never the small grid's
+    for(int refine = 0; refine <= 1; refine++)
+    {
+        int width = 400, height = 400;
+        size_t cells = (size_t) width * height;
+        vector<int> plane(cells, 0);
+        vector<int*> rows(height);
+        for(int row = 0; row < height; row++)
+            rows[row] = &plane[(size_t) row * width];
+        PreviewOptions preview;
+        preview.factor = 4;
+        preview.refine = refine;
+        PreviewReport report;
+        RunStats stats;
+        srand(3);
+        previewParticleMap(rows.data(), width, height, 200, 200, 100, 40000, 80, 100, -1, WalkOptions(), preview, report, muted, stats);
+        bool consistent = refine ? stats.deadEnds.size() == (cells + 63) / 64 && stats.deadEndCells >= 0 && stats.deadEndCells <= (long long) cells
+                                 : stats.deadEnds.empty() && stats.deadEndCells < 0;
+        consistent = consistent && stats.particles >= report.particles && stats.steps > 0;
+        printf("  %-24s %s\n", refine ? "preview refine stats" : "preview stats", consistent ? "ok  " : "FAIL");
+        if(!consistent)
+            printf("    %zu dead-end words and %lld dead-end cells for a %dx%d map\n", stats.deadEnds.size(), stats.deadEndCells, width, height);
+        failures += !consistent;
+    }
+    checks += 2;
+
+    if(!stored)
+    {
+        FILE* file = fopen(baselineFile, "w");
+        for(int k = 0; file && k < cases; k++)
+            fprintf(file, "%.3f %s\n", throughputs[k], CHECK_CASES[k].name);
+        if(!file || fclose(file) != 0)
+            printf("Error -- Could not write %s.\n", baselineFile);
+        else
+            printf("Wrote the throughput baseline to %s.\n", baselineFile);
+    }
+    if(slowCases > 0 && !perfGate)
+        printf("Warning: %d of %d cases ran slower than the baseline allows (not failed, --no-perf-gate).\n", slowCases, cases);
+    if(failures > 0)
+        printf("Check failed: %d of %d cases.\n", failures, checks);
+    else
+        printf("Check passed.\n");
+    return failures == 0;
+} //End of runCheck method
+
+//Method hashBytes will continue an FNV-1a hash over a block of bytes
+unsigned long long hashBytes(const void* data, size_t length, unsigned long long hash)
+{
+    const unsigned char* bytes = (const unsigned char*) data;
+    for(size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+} //End of hashBytes method
+
+//Method printCounters will print the --counters table: a row per stage that ran, n/a for the events that couldn't
+//be counted, and the instructions per cycle when both are there
+void printCounters(const StageCounters& counters)
+{
+    static const char* stageNames[COUNTED_STAGES] = {"makeParticleMap", "smoothMap", "normalizeMap", "generateIsland",
+                                                     "fusedPipeline", "labelComponents", "distanceToCoast"};
+    bool hardware = false;
+    for(int counter = 0; counter < PERF_TASK_CLOCK; counter++)
+        hardware = hardware || counters.open[counter];
+    printf("  Counters:              user space, worker threads and shards included");
+    if(!hardware)
+        printf(" (hardware events unavailable: %s)", counters.error ? strerror(counters.error) : "unknown");
+    printf("\n");
+    printf("    %-16s %14s %14s %6s %12s %12s %12s %10s\n", "Stage", "cycles", "instructions", "IPC", "LLC misses",
+           "branch miss", "dTLB misses", "CPU ms");
+    for(int stage = 0; stage < COUNTED_STAGES; stage++)
+    {
+        if(!counters.ran[stage])
+            continue;
+        const long long* counts = counters.counts[stage];
+        char cells[PERF_COUNTERS][24], ipc[16];
+        for(int counter = 0; counter < PERF_COUNTERS; counter++)
+        {
+            if(!counters.open[counter])
+                snprintf(cells[counter], sizeof(cells[counter]), "n/a");
+            else if(counter == PERF_TASK_CLOCK)
+                snprintf(cells[counter], sizeof(cells[counter]), "%.1f", counts[counter] / 1e6); //nanoseconds
+            else
+                snprintf(cells[counter], sizeof(cells[counter]), "%lld", counts[counter]);
+        }
+        if(counters.open[PERF_CYCLES] && counters.open[PERF_INSTRUCTIONS] && counts[PERF_CYCLES] > 0)
+            snprintf(ipc, sizeof(ipc), "%.2f", (double) counts[PERF_INSTRUCTIONS] / counts[PERF_CYCLES]);
+        else
+            snprintf(ipc, sizeof(ipc), "n/a");
+        printf("    %-16s %14s %14s %6s %12s %12s %12s %10s\n", stageNames[stage], cells[PERF_CYCLES], cells[PERF_INSTRUCTIONS],
+               ipc, cells[PERF_LLC_MISSES], cells[PERF_BRANCH_MISSES], cells[PERF_DTLB_MISSES], cells[PERF_TASK_CLOCK]);
+    }
+} //End of printCounters method
+
+//Method openCounters will open the --counters events for this process, counting user space only
+//Each event is opened on its own rather than as a group, so the ones a machine lacks (or perf_event_paranoid forbids)
+//just show up as n/a. Worker threads and shard processes started later inherit the events and their counts are
+//added in when they end, which all of them do before their stage does. The writer thread is already running and
+//is left out, like the writing it does
+void openCounters(PerfCounters& perf, StageCounters& counters)
+{
+    counters.on = true;
+#ifdef ISLAND_PERF_COUNTERS
+    static const unsigned int types[PERF_COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                                      PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_SOFTWARE};
+    static const unsigned long long configs[PERF_COUNTERS] =
+    {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_SW_TASK_CLOCK
+    };
+    for(int counter = 0; counter < PERF_COUNTERS; counter++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[counter];
+        attr.config = configs[counter];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.inherit = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        perf.fd[counter] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        counters.open[counter] = perf.fd[counter] >= 0;
+        if(perf.fd[counter] < 0 && counters.error == 0)
+            counters.error = errno;
+    }
+#else
+    counters.error = ENOSYS;
+    (void) perf;
+#endif
+} //End of openCounters method
+
+//Method readCounters will read every open counter, scaled up for the time the kernel had it switched out
+void readCounters(const PerfCounters& perf, long long values[PERF_COUNTERS])
+{
+    for(int counter = 0; counter < PERF_COUNTERS; counter++)
+    {
+        values[counter] = 0;
+#ifdef ISLAND_PERF_COUNTERS
+        unsigned long long reading[3]; //value, time enabled, time running
+        if(perf.fd[counter] >= 0 && read(perf.fd[counter], reading, sizeof(reading)) == (ssize_t) sizeof(reading))
+            values[counter] = reading[2] > 0 && reading[2] < reading[1] ? (long long) ((double) reading[0] * reading[1] / reading[2]) : (long long) reading[0];
+#endif
+    }
+    (void) perf;
+} //End of readCounters method
+
+//Method countStage will add what the counters counted since before to a stage
+void countStage(const PerfCounters& perf, const long long before[PERF_COUNTERS], StageCounters& counters, CountedStage stage)
+{
+    if(!counters.on)
+        return;
+    long long after[PERF_COUNTERS];
+    readCounters(perf, after);
+    for(int counter = 0; counter < PERF_COUNTERS; counter++)
+        counters.counts[stage][counter] += after[counter] - before[counter];
+    counters.ran[stage] = true;
+} //End of countStage method
+
+//Method closeCounters will close the --counters events
+void closeCounters(PerfCounters& perf)
+{
+    for(int counter = 0; counter < PERF_COUNTERS; counter++)
+    {
+        if(perf.fd[counter] >= 0)
+            close(perf.fd[counter]);
+        perf.fd[counter] = -1;
+    }
+} //End of closeCounters method
+
+//Method secondsSince will return the wall-clock seconds elapsed since start
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+} //End of secondsSince method
+
+//Method cacheEntryPath will name the cache file of a parameter set: an FNV-1a hash of the parameters in hex
+std::string cacheEntryPath(const char* cacheDir, const CacheParams& params)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    const unsigned char* bytes = (const unsigned char*) &params;
+    for(size_t i = 0; i < sizeof(params); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.isl", hash);
+    return std::string(cacheDir) + name;
+} //End of cacheEntryPath method
+
+//Method openCacheEntry will map the cache file for a parameter set and point the row arrays into its planes
+//Returns false on a miss, including files that are truncated or were written for different parameters
+bool openCacheEntry(const char* cacheDir, const CacheParams& params, CacheEntry& entry)
+{
+#ifdef ISLAND_RESULT_CACHE
+    std::string path = cacheEntryPath(cacheDir, params);
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+    struct stat info;
+    if(fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(CacheHeader))
+    {
+        close(fd);
+        return false;
+    }
+    void* data = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+        return false;
+
+    const CacheHeader* header = (const CacheHeader*) data;
+    size_t cells = (size_t) params.width * params.height;
+    if(memcmp(header->magic, "ISLCACHE", 8) != 0 || memcmp(&header->params, &params, sizeof(params)) != 0
+       || header->fileSize != (unsigned long long) info.st_size || header->terrainOffset + cells > header->fileSize
+       || header->rawOffset % sizeof(int) != 0)
+    {
+        munmap(data, info.st_size);
+        return false;
+    }
+
+    entry.data = data;
+    entry.size = info.st_size;
+    char* base = (char*) data;
+    entry.raw.resize(params.height);
+    entry.normalized.resize(params.height);
+    entry.terrain.resize(params.height);
+    for(int row = 0; row < params.height; row++)
+    {
+        entry.raw[row] = (int*) (base + header->rawOffset) + (size_t) row * params.width;
+        entry.normalized[row] = (unsigned char*) (base + header->normalizedOffset) + (size_t) row * params.width;
+        entry.terrain[row] = base + header->terrainOffset + (size_t) row * params.width;
+    }
+
+    //Touch the file so eviction sees it as recently used
+    utimensat(AT_FDCWD, path.c_str(), 0, 0);
+    return true;
+#else
+    (void) cacheDir; (void) params; (void) entry;
+    return false;
+#endif
+} //End of openCacheEntry method
+
+//Method closeCacheEntry will unmap a cache entry opened by openCacheEntry
+void closeCacheEntry(CacheEntry& entry)
+{
+#ifdef ISLAND_RESULT_CACHE
+    if(entry.data)
+        munmap(entry.data, entry.size);
+#endif
+    entry.data = 0;
+} //End of closeCacheEntry method
+
+//Method storeCacheEntry will write the three planes of a finished run to the cache
+//The file is written under a temporary name and renamed into place so readers never see half an entry
+bool storeCacheEntry(const char* cacheDir, const CacheParams& params, const int* raw, int** normalized, char** island, const RunStats& stats)
+{
+#ifdef ISLAND_RESULT_CACHE
+    mkdir(cacheDir, 0777);
+    std::string path = cacheEntryPath(cacheDir, params);
+    std::string temp = path + ".tmp" + std::to_string((long long) getpid());
+    FILE* file = fopen(temp.c_str(), "wb");
+    if(!file)
+        return false;
+
+    size_t cells = (size_t) params.width * params.height;
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "ISLCACHE", 8);
+    header.params = params;
+    header.rawOffset = (sizeof(CacheHeader) + 63) & ~63ULL;
+    header.normalizedOffset = header.rawOffset + cells * sizeof(int);
+    header.terrainOffset = header.normalizedOffset + cells;
+    header.fileSize = header.terrainOffset + cells;
+    header.steps = stats.steps;
+    header.particles = stats.particles;
+    header.deadEndKills = stats.deadEndKills;
+    header.deadEndCells = stats.deadEndCells;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    vector<char> padding(header.rawOffset - sizeof(header), 0);
+    ok = ok && fwrite(padding.data(), 1, padding.size(), file) == padding.size();
+    ok = ok && fwrite(raw, sizeof(int), cells, file) == cells;
+    vector<unsigned char> line(params.width);
+    for(int row = 0; row < params.height && ok; row++)
+    {
+        for(int col = 0; col < params.width; col++)
+            line[col] = (unsigned char) normalized[row][col];
+        ok = fwrite(line.data(), 1, params.width, file) == (size_t) params.width;
+    }
+    for(int row = 0; row < params.height && ok; row++)
+        ok = fwrite(island[row], 1, params.width, file) == (size_t) params.width;
+    ok = (fclose(file) == 0) && ok;
+    if(!ok || rename(temp.c_str(), path.c_str()) != 0)
+    {
+        remove(temp.c_str());
+        return false;
+    }
+    return true;
+#else
+    (void) cacheDir; (void) params; (void) raw; (void) normalized; (void) island; (void) stats;
+    return false;
+#endif
+} //End of storeCacheEntry method
+
+//Method evictCache will delete the least recently used cache entries until the directory fits in maxBytes
+void evictCache(const char* cacheDir, long long maxBytes)
+{
+#ifdef ISLAND_RESULT_CACHE
+    struct CachedFile
+    {
+        std::string path;
+        long long size;
+        struct timespec used;
+    };
+    vector<CachedFile> files;
+    long long total = 0;
+    DIR* dir = opendir(cacheDir);
+    if(!dir)
+        return;
+    while(struct dirent* item = readdir(dir))
+    {
+        size_t length = strlen(item->d_name);
+        if(length < 4 || strcmp(item->d_name + length - 4, ".isl") != 0)
+            continue;
+        CachedFile file;
+        file.path = std::string(cacheDir) + "/" + item->d_name;
+        struct stat info;
+        if(stat(file.path.c_str(), &info) != 0)
+            continue;
+        file.size = info.st_size;
+        file.used = info.st_mtim;
+        total += file.size;
+        files.push_back(file);
+    }
+    closedir(dir);
+
+    std::sort(files.begin(), files.end(), [](const CachedFile& a, const CachedFile& b)
+    {
+        return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+    });
+    for(size_t i = 0; i < files.size() && total > maxBytes; i++)
+    {
+        if(remove(files[i].path.c_str()) == 0)
+            total -= files[i].size;
+    }
+#else
+    (void) cacheDir; (void) maxBytes;
+#endif
+} //End of evictCache method
+
+//Method loadHeightmap will start the map from the heights in a file instead of zeros, for --heightmap
+//The file is mapped, not read, and is one of: a binary PGM (P5, 8 or 16 bits), a --cache-dir entry (its raw plane)
+//or the cells alone in row order, 4, 2 or 1 bytes each (int32, uint16 or uint8 in this machine's byte order), told
+//apart by the file size. Nothing is parsed per cell. With target > 0 the heights are scaled so the highest is target
+bool loadHeightmap(const char* fileName, int** map, int width, int height, int target, int threads)
+{
+#ifdef ISLAND_HEIGHTMAP
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int fd = open(fileName, O_RDONLY);
+    if(fd < 0)
+    {
+        printf("Error -- Could not open heightmap %s.\n", fileName);
+        return false;
+    }
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        printf("Error -- Heightmap %s is empty.\n", fileName);
+        return false;
+    }
+    size_t size = info.st_size;
+    void* data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+    {
+        printf("Error -- Could not map heightmap %s.\n", fileName);
+        return false;
+    }
+
+    //Work out where the cells start, how wide each is and what grid they were made for
+    const unsigned char* bytes = (const unsigned char*) data;
+    size_t cells = (size_t) width * height;
+    long long fileWidth = width, fileHeight = height;
+    size_t offset = 0;
+    int cellBytes = 0;
+    bool bigEndian = false;
+    const char* format = 0;
+    if(size >= 2 && bytes[0] == 'P' && bytes[1] == '5')
+    {
+        //The header is the width, height and maxval, separated by whitespace and # comments, then one whitespace byte
+        long long fields[3];
+        offset = 2;
+        for(int field = 0; field < 3; field++)
+        {
+            while(offset < size && (strchr(" \t\r\n", bytes[offset]) || bytes[offset] == '#'))
+            {
+                if(bytes[offset] == '#')
+                    while(offset < size && bytes[offset] != '\n')
+                        offset++;
+                else
+                    offset++;
+            }
+            fields[field] = -1;
+            for(; offset < size && bytes[offset] >= '0' && bytes[offset] <= '9' && fields[field] < INT_MAX; offset++)
+                fields[field] = std::max(fields[field], 0LL) * 10 + (bytes[offset] - '0');
+        }
+        if(offset >= size || !strchr(" \t\r\n", bytes[offset]) || fields[0] < 1 || fields[1] < 1 || fields[2] < 1 || fields[2] > 65535)
+        {
+            munmap(data, size);
+            printf("Error -- Heightmap %s is not a valid binary PGM.\n", fileName);
+            return false;
+        }
+        offset++;
+        fileWidth = fields[0];
+        fileHeight = fields[1];
+        cellBytes = fields[2] < 256 ? 1 : 2;
+        bigEndian = true;
+        format = cellBytes == 1 ? "8-bit PGM" : "16-bit PGM";
+    }
+    else if(size >= sizeof(CacheHeader) && memcmp(bytes, "ISLCACHE", 8) == 0)
+    {
+        const CacheHeader* header = (const CacheHeader*) data;
+        fileWidth = header->params.width;
+        fileHeight = header->params.height;
+        offset = header->rawOffset;
+        cellBytes = sizeof(int);
+        format = "cache entry";
+    }
+    else if(size == cells * sizeof(int))
+    {
+        cellBytes = sizeof(int);
+        format = "raw int32";
+    }
+    else if(size == cells * sizeof(unsigned short))
+    {
+        cellBytes = sizeof(unsigned short);
+        format = "raw uint16";
+    }
+    else if(size == cells)
+    {
+        cellBytes = 1;
+        format = "raw uint8";
+    }
+    else
+    {
+        munmap(data, size);
+        printf("Error -- Heightmap %s is not a PGM or a cache entry, and its %lld bytes are not 1, 2 or 4 per cell of the %dx%d grid.\n", fileName, (long long) size, width, height);
+        return false;
+    }
+    if(fileWidth != width || fileHeight != height)
+    {
+        munmap(data, size);
+        printf("Error -- Heightmap %s is %lldx%lld, the grid is %dx%d.\n", fileName, fileWidth, fileHeight, width, height);
+        return false;
+    }
+    if(offset > size || (size - offset) / cellBytes < cells)
+    {
+        munmap(data, size);
+        printf("Error -- Heightmap %s is truncated.\n", fileName);
+        return false;
+    }
+
+    //Copy the cells into the map, then scale them to the target in place, a band of rows per thread
+    const unsigned char* first = bytes + offset;
+    vector<long long> highest(std::max(threads, 1), 0);
+    parallelBands(height, threads, [&](int band, int firstRow, int endRow)
+    {
+        for(int row = firstRow; row < endRow; row++)
+        {
+            const unsigned char* in = first + (size_t) row * width * cellBytes;
+            int* out = map[row];
+            if(cellBytes == 4)
+            {
+                memcpy(out, in, width * sizeof(int));
+                for(int col = 0; col < width; col++)
+                    out[col] = std::max(out[col], 0);
+            }
+            else if(cellBytes == 2 && bigEndian)
+                for(int col = 0; col < width; col++)
+                    out[col] = in[2 * col] << 8 | in[2 * col + 1];
+            else if(cellBytes == 2)
+                for(int col = 0; col < width; col++)
+                {
+                    unsigned short cell;
+                    memcpy(&cell, in + 2 * col, sizeof(cell));
+                    out[col] = cell;
+                }
+            else
+                for(int col = 0; col < width; col++)
+                    out[col] = in[col];
+            highest[band] = std::max(highest[band], (long long) findMax(&out, width, 1));
+        }
+    });
+    munmap(data, size);
+    long long top = *std::max_element(highest.begin(), highest.end());
+    if(target > 0 && top > 0 && top != target)
+    {
+        parallelBands(height, threads, [&](int, int firstRow, int endRow)
+        {
+            for(int row = firstRow; row < endRow; row++)
+                for(int col = 0; col < width; col++)
+                    map[row][col] = (int) ((map[row][col] * (long long) target + top / 2) / top);
+        });
+    }
+    printf("Starting from heightmap %s (%s, highest %lld", fileName, format, top);
+    if(target > 0 && top > 0)
+        printf(" scaled to %d", target);
+    printf(") in %.3f s.\n", secondsSince(start));
+    return true;
+#else
+    (void) fileName; (void) map; (void) width; (void) height; (void) target; (void) threads;
+    return false;
+#endif
+} //End of loadHeightmap method
+
+//Method parallelBands will split the rows [0, height) into one contiguous band per thread and run
+//work(band, firstRow, endRow) for each band on its own thread (the last band runs on the calling thread)
+template<class Work>
+void parallelBands(int height, int threads, Work work)
+{
+    int bands = threads < height ? threads : height;
+    if(bands < 1)
+        bands = 1;
+    vector<std::thread> workers;
+    for(int band = 0; band < bands; band++)
+    {
+        int firstRow = (int) ((long long) height * band / bands);
+        int endRow = (int) ((long long) height * (band + 1) / bands);
+        if(band == bands - 1)
+            work(band, firstRow, endRow);
+        else
+            workers.push_back(std::thread(work, band, firstRow, endRow));
+    }
+    for(size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+} //End of parallelBands method
+
+//Method formatRows will have the map printers' rows formatted on output.threads threads and appended in row order
+//The rows go in groups of one band per thread, each band about a writer chunk of text (rowBytes is the file text of
+//a row), so the text waiting at any time stays a few chunks. format(row, text) formats one row into its band's text.
+//Once a group's bands are appended in order, serial(firstRow, endRow) runs over the group's rows on this thread, for
+//the --view pooling that has to see the rows in order
+template<class Format, class Serial>
+void formatRows(int height, size_t rowBytes, OutputWriter& output, Format format, Serial serial)
+{
+    int threads = std::max(output.threads, 1);
+    int bandRows = (int) std::max<size_t>(1, std::min<size_t>(OutputWriter::CHUNK / std::max<size_t>(rowBytes, 1), height));
+    vector<BandText> bands(threads);
+    for(int firstRow = 0; firstRow < height; firstRow += threads * bandRows)
+    {
+        int groupRows = (int) std::min<long long>((long long) threads * bandRows, height - firstRow);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        parallelBands((groupRows + bandRows - 1) / bandRows, threads, [&](int band, int firstBand, int endBand)
+        {
+            BandText& text = bands[band];
+            text.console.clear();
+            text.file.clear();
+            text.both.clear();
+            int endRow = std::min(firstRow + endBand * bandRows, firstRow + groupRows);
+            for(int row = firstRow + firstBand * bandRows; row < endRow; row++)
+                format(row, text);
+        });
+        output.formatSeconds += secondsSince(start);
+        for(int band = 0; band < threads && band * bandRows < groupRows; band++)
+        {
+            const BandText& text = bands[band];
+            output.append(OUTPUT_CONSOLE, text.console.data(), text.console.size());
+            output.append(OUTPUT_FILE, text.file.data(), text.file.size());
+            output.append(OUTPUT_BOTH, text.both.data(), text.both.size());
+            output.formatBytes += text.console.size() + text.file.size() + text.both.size();
+        }
+        serial(firstRow, firstRow + groupRows);
+    }
+} //End of formatRows method
+
+//Method labelComponents will label the connected land masses and bodies of water of a terrain map
+//Union-find over cell indices where the smaller index always becomes the root, so every root is the first cell of
+//its component in row order:
+// 1. each thread labels its own band of rows and flattens it (every cell points at its band-local root)
+// 2. the rows on either side of each band border are merged, and the roots that got re-parented are flattened
+// 3. each thread points its cells at their final root (at most two hops after step 2)
+// 4. roots are numbered in row order and each thread labels its cells and gathers area, bounding box and centroid
+//labels ends up holding the component id of every cell, row-major
+void labelComponents(char** island, int width, int height, const TerrainPalette& palette, int threads, vector<unsigned int>& labels, vector<Component>& components)
+{
+    long long cells = (long long) width * height;
+    labels.resize(cells);
+    components.clear();
+    if(cells == 0)
+        return;
+    unsigned int* parent = labels.data();
+    int bands = threads < height ? threads : height;
+    vector<int> bandStart(bands + 1);
+    for(int band = 0; band <= bands; band++)
+        bandStart[band] = (int) ((long long) height * band / bands);
+
+    //1. Band-local labeling, looking back at the already labeled neighbors. Land cells need only one link when the
+    //north cell is land (west, north-west and north-east all touch it) and otherwise west or north-west plus
+    //north-east; water links to north and west
+    vector<unsigned char> isLand(cells);
+    parallelBands(height, bands, [&](int, int firstRow, int endRow)
+    {
+        for(int row = firstRow; row < endRow; row++)
+        {
+            unsigned char* here = &isLand[(size_t) row * width];
+            for(int col = 0; col < width; col++)
+                here[col] = !palette.water[(unsigned char) island[row][col]];
+            const unsigned char* above = row > firstRow ? here - width : 0;
+            for(int col = 0; col < width; col++)
+            {
+                unsigned int cell = (unsigned int) row * width + col;
+                unsigned int root = cell;
+                if(here[col])
+                {
+                    if(above && above[col])
+                        root = findRoot(parent, cell - width);
+                    else
+                    {
+                        if(col > 0 && here[col - 1])
+                            root = findRoot(parent, cell - 1);
+                        else if(above && col > 0 && above[col - 1])
+                            root = findRoot(parent, cell - width - 1);
+                        if(above && col < width - 1 && above[col + 1])
+                            root = linkRoots(parent, root, cell, cell - width + 1);
+                    }
+                }
+                else
+                {
+                    if(above && !above[col])
+                        root = findRoot(parent, cell - width);
+                    if(col > 0 && !here[col - 1])
+                        root = linkRoots(parent, root, cell, cell - 1);
+                }
+                parent[cell] = root;
+            }
+        }
+        for(unsigned int cell = (unsigned int) firstRow * width; cell < (unsigned int) endRow * width; cell++)
+            parent[cell] = parent[parent[cell]];
+    });
+
+    //2. Merge across the band borders, then flatten every root that stopped being one
+    vector<unsigned int> reparented;
+    for(int band = 1; band < bands; band++)
+    {
+        int row = bandStart[band];
+        const unsigned char* here = &isLand[(size_t) row * width];
+        const unsigned char* above = here - width;
+        for(int col = 0; col < width; col++)
+        {
+            unsigned int cell = (unsigned int) row * width + col;
+            if(above[col] == here[col])
+                uniteCells(parent, cell, cell - width, &reparented);
+            if(here[col] && col > 0 && above[col - 1])
+                uniteCells(parent, cell, cell - width - 1, &reparented);
+            if(here[col] && col < width - 1 && above[col + 1])
+                uniteCells(parent, cell, cell - width + 1, &reparented);
+        }
+    }
+    for(size_t i = 0; i < reparented.size(); i++)
+        parent[reparented[i]] = findRoot(parent, reparented[i]);
+
+    //3. Point every cell at its final root; only cells whose band-local root was re-parented change. The roots left
+    //in each band are counted on the way for step 4
+    vector<unsigned int> firstId(bands + 1, 0);
+    parallelBands(height, bands, [&](int band, int firstRow, int endRow)
+    {
+        unsigned int roots = 0;
+        for(unsigned int cell = (unsigned int) firstRow * width; cell < (unsigned int) endRow * width; cell++)
+        {
+            unsigned int root = parent[cell];
+            if(parent[root] != root)
+                parent[cell] = parent[root];
+            roots += root == cell;
+        }
+        firstId[band + 1] = roots;
+    });
+
+    //4. Roots come first in row order, so numbering them band by band in row order gives ids in row order. Each
+    //band numbers its own roots (parking the id in the root's entry, tagged with the top bit), then labels its cells
+    //and gathers their stats. A component rooted in an earlier band must cross the band's top row to reach it, so
+    //those few foreign ids are looked up in a small sorted list; the band's own ids index a dense array
+    const unsigned int TAG = 0x80000000u;
+    for(int band = 0; band < bands; band++)
+        firstId[band + 1] += firstId[band];
+    components.resize(firstId[bands]);
+    vector<unsigned int> rootCell(firstId[bands]);
+    parallelBands(height, bands, [&](int band, int firstRow, int endRow)
+    {
+        unsigned int id = firstId[band];
+        for(unsigned int cell = (unsigned int) firstRow * width; cell < (unsigned int) endRow * width; cell++)
+        {
+            if(parent[cell] != cell)
+                continue;
+            Component& component = components[id];
+            component.land = isLand[cell];
+            component.touchesEdge = false;
+            component.area = 0;
+            component.minX = width;
+            component.minY = height;
+            component.maxX = component.maxY = -1;
+            component.sumX = component.sumY = 0;
+            rootCell[id] = cell;
+            parent[cell] = TAG | id++;
+        }
+    });
+
+    vector<vector<Component> > ownStats(bands), foreignStats(bands);
+    vector<vector<unsigned int> > foreignIds(bands);
+    parallelBands(height, bands, [&](int band, int firstRow, int endRow)
+    {
+        //Ids of the components entering the band from above
+        vector<unsigned int>& foreign = foreignIds[band];
+        for(int col = 0; col < width && band > 0; col++)
+        {
+            unsigned int root = parent[(unsigned int) firstRow * width + col];
+            unsigned int id = (root & TAG) ? root & ~TAG : parent[root] & ~TAG;
+            if(id < firstId[band])
+                foreign.push_back(id);
+        }
+        std::sort(foreign.begin(), foreign.end());
+        foreign.erase(std::unique(foreign.begin(), foreign.end()), foreign.end());
+
+        Component empty;
+        empty.area = 0;
+        empty.touchesEdge = false;
+        empty.minX = width;
+        empty.minY = height;
+        empty.maxX = empty.maxY = -1;
+        empty.sumX = empty.sumY = 0;
+        ownStats[band].assign(firstId[band + 1] - firstId[band], empty);
+        foreignStats[band].assign(foreign.size(), empty);
+
+        unsigned int lastId = ~0u;
+        Component* stats = 0;
+        for(int row = firstRow; row < endRow; row++)
+        {
+            for(int col = 0; col < width; col++)
+            {
+                unsigned int cell = (unsigned int) row * width + col;
+                unsigned int root = parent[cell];
+                unsigned int id = (root & TAG) ? root & ~TAG : parent[root] & ~TAG;
+                if(!(root & TAG))
+                    parent[cell] = id;
+                if(id != lastId)
+                {
+                    lastId = id;
+                    if(id >= firstId[band])
+                        stats = &ownStats[band][id - firstId[band]];
+                    else
+                        stats = &foreignStats[band][std::lower_bound(foreign.begin(), foreign.end(), id) - foreign.begin()];
+                }
+                stats->area++;
+                stats->minX = std::min(stats->minX, col);
+                stats->maxX = std::max(stats->maxX, col);
+                stats->minY = std::min(stats->minY, row);
+                stats->maxY = row;
+                stats->sumX += col;
+                stats->sumY += row;
+                if(row == 0 || col == 0 || row == height - 1 || col == width - 1)
+                    stats->touchesEdge = true;
+            }
+        }
+    });
+
+    //Roots get their plain id back and the per-band stats are folded into the components
+    for(unsigned int id = 0; id < firstId[bands]; id++)
+        parent[rootCell[id]] = id;
+    for(int band = 0; band < bands; band++)
+    {
+        for(size_t i = 0; i < ownStats[band].size() + foreignStats[band].size(); i++)
+        {
+            bool own = i < ownStats[band].size();
+            const Component& part = own ? ownStats[band][i] : foreignStats[band][i - ownStats[band].size()];
+            Component& component = components[own ? firstId[band] + i : foreignIds[band][i - ownStats[band].size()]];
+            component.area += part.area;
+            component.touchesEdge = component.touchesEdge || part.touchesEdge;
+            component.minX = std::min(component.minX, part.minX);
+            component.minY = std::min(component.minY, part.minY);
+            component.maxX = std::max(component.maxX, part.maxX);
+            component.maxY = std::max(component.maxY, part.maxY);
+            component.sumX += part.sumX;
+            component.sumY += part.sumY;
+        }
+    }
+} //End of labelComponents method
+
+//Method findRoot will follow parent links to the root of a cell, halving the path as it goes
+unsigned int findRoot(unsigned int* parent, unsigned int cell)
+{
+    while(parent[cell] != cell)
+    {
+        parent[cell] = parent[parent[cell]];
+        cell = parent[cell];
+    }
+    return cell;
+} //End of findRoot method
+
+//Method linkRoots will merge the set of a neighbor into root, the set the current cell is joining
+//root equal to cell means the cell has not joined a set yet, in which case it simply takes the neighbor's root
+unsigned int linkRoots(unsigned int* parent, unsigned int root, unsigned int cell, unsigned int neighbor)
+{
+    unsigned int other = findRoot(parent, neighbor);
+    if(root == cell || root == other)
+        return other;
+    if(root < other)
+    {
+        parent[other] = root;
+        return root;
+    }
+    parent[root] = other;
+    return other;
+} //End of linkRoots method
+
+//Method uniteCells will merge the sets of two cells, keeping the smaller root index as the root
+//Roots that get a parent are appended to reparented when it is given
+void uniteCells(unsigned int* parent, unsigned int a, unsigned int b, vector<unsigned int>* reparented)
+{
+    a = findRoot(parent, a);
+    b = findRoot(parent, b);
+    if(a == b)
+        return;
+    if(a < b)
+        std::swap(a, b);
+    parent[a] = b;
+    if(reparented)
+        reparented->push_back(a);
+} //End of uniteCells method
+
+//Method reportComponents will print a summary of the labeled components and write every one of them to fileName
+void reportComponents(const vector<Component>& components, const char* fileName)
+{
+    vector<int> order(components.size());
+    long long landMasses = 0, lakes = 0, seas = 0;
+    for(size_t i = 0; i < components.size(); i++)
+    {
+        order[i] = (int) i;
+        if(components[i].land)
+            landMasses++;
+        else if(components[i].touchesEdge)
+            seas++;
+        else
+            lakes++;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return components[a].area > components[b].area; });
+
+    printf("\nComponents: %lld land masses, %lld lakes, %lld open water (all listed in %s)\n", landMasses, lakes, seas, fileName);
+    FILE* file = fopen(fileName, "w");
+    if(file)
+        fprintf(file, "id,type,area,minX,minY,maxX,maxY,centroidX,centroidY\n");
+    int shown = 0;
+    for(size_t i = 0; i < order.size(); i++)
+    {
+        const Component& component = components[order[i]];
+        const char* type = component.land ? "land" : (component.touchesEdge ? "sea" : "lake");
+        double centroidX = component.sumX / component.area, centroidY = component.sumY / component.area;
+        if(file)
+            fprintf(file, "%d,%s,%lld,%d,%d,%d,%d,%.2f,%.2f\n", order[i], type, component.area, component.minX, component.minY,
+                    component.maxX, component.maxY, centroidX, centroidY);
+        if(component.touchesEdge && !component.land)
+            continue;
+        if(shown++ < 10)
+            printf("  %-4s #%-6d area %-8lld box (%d,%d)-(%d,%d) centroid (%.1f, %.1f)\n", type, order[i], component.area,
+                   component.minX, component.minY, component.maxX, component.maxY, centroidX, centroidY);
+    }
+    if(file)
+        fclose(file);
+} //End of reportComponents method
+
+//Method isCoast will check whether a cell is part of the shoreline: a beach cell (the palette's first land class) or
+//a land cell with water on one of its four sides
+bool isCoast(char** island, int width, int height, const TerrainPalette& palette, int x, int y)
+{
+    const bool* water = palette.water;
+    char glyph = island[y][x];
+    if(glyph == palette.beach)
+        return true;
+    if(water[(unsigned char) glyph])
+        return false;
+    return (x > 0 && water[(unsigned char) island[y][x - 1]])
+        || (x < width - 1 && water[(unsigned char) island[y][x + 1]])
+        || (y > 0 && water[(unsigned char) island[y - 1][x]])
+        || (y < height - 1 && water[(unsigned char) island[y + 1][x]]);
+} //End of isCoast method
+
+//Method distanceToCoast will compute every cell's exact Euclidean distance to the nearest shoreline cell
+//Meijster's separable transform, O(width * height):
+// 1. vertical distances to the nearest coast cell in the same column, swept down and then up a row at a time so
+//    each sweep is a straight loop over a row (vectorizes), with each thread owning a range of columns
+// 2. each thread takes a band of rows and finds, per row, the lower envelope of the parabolas (x - i)^2 + g(i)^2
+//Distances are rounded to whole cells and saturate at 65535, which is also the value when there is no coast at all
+void distanceToCoast(char** island, int width, int height, const TerrainPalette& palette, int threads, vector<unsigned short>& distances)
+{
+    long long cells = (long long) width * height;
+    int infinity = width + height;
+    vector<int> vertical(cells);
+    distances.assign(cells, 65535);
+
+    //1. Column sweeps, split into column ranges so each thread streams whole rows of its range
+    int columnThreads = threads < width ? threads : width;
+    vector<std::thread> workers;
+    for(int part = 0; part < columnThreads; part++)
+    {
+        int firstCol = (int) ((long long) width * part / columnThreads);
+        int endCol = (int) ((long long) width * (part + 1) / columnThreads);
+        workers.push_back(std::thread([&, firstCol, endCol]()
+        {
+            for(int row = 0; row < height; row++)
+            {
+                int* line = &vertical[(size_t) row * width];
+                const int* above = row > 0 ? line - width : 0;
+                for(int col = firstCol; col < endCol; col++)
+                {
+                    if(isCoast(island, width, height, palette, col, row))
+                        line[col] = 0;
+                    else
+                        line[col] = above ? std::min(above[col] + 1, infinity) : infinity;
+                }
+            }
+            for(int row = height - 2; row >= 0; row--)
+            {
+                int* line = &vertical[(size_t) row * width];
+                const int* below = line + width;
+                for(int col = firstCol; col < endCol; col++)
+                    line[col] = std::min(line[col], below[col] + 1);
+            }
+        }));
+    }
+    for(size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    //2. Row envelopes: s holds the parabola centers of the envelope and t where each one starts to be the lowest
+    parallelBands(height, threads, [&](int, int firstRow, int endRow)
+    {
+        vector<int> s(width), t(width);
+        for(int row = firstRow; row < endRow; row++)
+        {
+            const int* g = &vertical[(size_t) row * width];
+            unsigned short* out = &distances[(size_t) row * width];
+            int q = 0;
+            s[0] = 0;
+            t[0] = 0;
+            for(int u = 1; u < width; u++)
+            {
+                while(q >= 0 && (long long) (t[q] - s[q]) * (t[q] - s[q]) + (long long) g[s[q]] * g[s[q]]
+                                > (long long) (t[q] - u) * (t[q] - u) + (long long) g[u] * g[u])
+                    q--;
+                if(q < 0)
+                {
+                    q = 0;
+                    s[0] = u;
+                }
+                else
+                {
+                    //First column where parabola u is lower than parabola s[q] (floor division, the numerator can be negative)
+                    long long numerator = (long long) u * u - (long long) s[q] * s[q] + (long long) g[u] * g[u] - (long long) g[s[q]] * g[s[q]];
+                    long long denominator = 2LL * (u - s[q]);
+                    long long separator = numerator >= 0 ? numerator / denominator : -((-numerator + denominator - 1) / denominator);
+                    if(separator + 1 < width)
+                    {
+                        q++;
+                        s[q] = u;
+                        t[q] = (int) (separator + 1);
+                    }
+                }
+            }
+            for(int u = width - 1; u >= 0; u--)
+            {
+                int nearest = s[q];
+                if(g[nearest] < infinity)
+                {
+                    double distance = sqrt((double) (u - nearest) * (u - nearest) + (double) g[nearest] * g[nearest]);
+                    out[u] = distance < 65535 ? (unsigned short) (distance + 0.5) : 65535;
+                }
+                if(u == t[q])
+                    q--;
+            }
+        }
+    });
+} //End of distanceToCoast method
+
+//Method writeDistancePlane will write a distance plane as a 16-bit binary PGM image (big-endian, as PGM requires)
+void writeDistancePlane(const vector<unsigned short>& distances, int width, int height, const char* fileName)
+{
+    ofstream pgm(fileName, std::ios::binary);
+    pgm << "P5\n" << width << " " << height << "\n65535\n";
+    vector<unsigned char> line((size_t) width * 2);
+    for(int row = 0; row < height; row++)
+    {
+        for(int col = 0; col < width; col++)
+        {
+            unsigned short distance = distances[(size_t) row * width + col];
+            line[2 * col] = distance >> 8;
+            line[2 * col + 1] = distance & 0xFF;
+        }
+        pgm.write((const char*) line.data(), line.size());
+    }
+} //End of writeDistancePlane method
+
+//Method encode will code one bit with an adaptive probability
+void RangeEncoder::encode(unsigned short& probability, int bit)
+{
+    unsigned int bound = (range >> 11) * probability;
+    if(bit == 0)
+    {
+        range = bound;
+        probability += (2048 - probability) >> 5;
+    }
+    else
+    {
+        low += bound;
+        range -= bound;
+        probability -= probability >> 5;
+    }
+    if(range < (1u << 24))
+    {
+        range <<= 8;
+        shiftLow();
+    }
+} //End of encode method
+
+//Method shiftLow will move the top byte of low out, holding back 0xFF bytes until it knows whether a carry reaches them
+void RangeEncoder::shiftLow()
+{
+    if((unsigned int) low < 0xFF000000u || (low >> 32) != 0)
+    {
+        unsigned char carry = (unsigned char) (low >> 32);
+        unsigned char pendingByte = cache;
+        do
+        {
+            bytes.push_back(pendingByte + carry);
+            pendingByte = 0xFF;
+        } while(--cacheSize != 0);
+        cache = (unsigned char) (low >> 24);
+    }
+    cacheSize++;
+    low = (low & 0x00FFFFFF) << 8;
+} //End of shiftLow method
+
+//Method finish will flush the last bytes of low
+void RangeEncoder::finish()
+{
+    for(int i = 0; i < 5; i++)
+        shiftLow();
+} //End of finish method
+
+//Method RangeDecoder will start decoding a section (the encoder's first byte is always 0)
+RangeDecoder::RangeDecoder(const unsigned char* data, size_t size) : next(data), end(data + size)
+{
+    for(int i = 0; i < 5; i++)
+        code = (code << 8) | nextByte();
+} //End of RangeDecoder method
+
+//Method decode will read one bit coded with the given probability
+int RangeDecoder::decode(unsigned short& probability)
+{
+    unsigned int bound = (range >> 11) * probability;
+    int bit;
+    if(code < bound)
+    {
+        range = bound;
+        probability += (2048 - probability) >> 5;
+        bit = 0;
+    }
+    else
+    {
+        code -= bound;
+        range -= bound;
+        probability -= probability >> 5;
+        bit = 1;
+    }
+    if(range < (1u << 24))
+    {
+        range <<= 8;
+        code = (code << 8) | nextByte();
+    }
+    return bit;
+} //End of decode method
+
+//Method encodeTree will code an 8-bit value most significant bit first, each bit in the context of the ones before it
+void encodeTree(RangeEncoder& encoder, unsigned short* probabilities, int value)
+{
+    int node = 1;
+    for(int bit = 7; bit >= 0; bit--)
+    {
+        int b = (value >> bit) & 1;
+        encoder.encode(probabilities[node], b);
+        node = (node << 1) | b;
+    }
+} //End of encodeTree method
+
+//Method decodeTree will read back a value coded by encodeTree
+int decodeTree(RangeDecoder& decoder, unsigned short* probabilities)
+{
+    int node = 1;
+    while(node < 256)
+        node = (node << 1) | decoder.decode(probabilities[node]);
+    return node - 256;
+} //End of decodeTree method
+
+//Method encodeRunLength will code a run length (at least 1): its bit count in unary, then the bits below the top one
+void encodeRunLength(RangeEncoder& encoder, MapModel& model, unsigned int length)
+{
+    int bits = 32 - __builtin_clz(length);
+    for(int i = 1; i < bits; i++)
+        encoder.encode(model.lengthPrefix[i - 1], 1);
+    if(bits < 32)
+        encoder.encode(model.lengthPrefix[bits - 1], 0);
+    for(int bit = bits - 2; bit >= 0; bit--)
+        encoder.encode(model.lengthBits[bits * 32 + bit], (length >> bit) & 1);
+} //End of encodeRunLength method
+
+//Method decodeRunLength will read back a run length coded by encodeRunLength
+unsigned int decodeRunLength(RangeDecoder& decoder, MapModel& model)
+{
+    int bits = 1;
+    while(bits < 32 && decoder.decode(model.lengthPrefix[bits - 1]))
+        bits++;
+    unsigned int length = 1;
+    for(int bit = bits - 2; bit >= 0; bit--)
+        length = (length << 1) | decoder.decode(model.lengthBits[bits * 32 + bit]);
+    return length;
+} //End of decodeRunLength method
+
+//Method medianPrediction will predict a cell from its left, upper and upper-left neighbors (LOCO-I's median edge
+//detector: the smaller or larger neighbor next to an edge, the plane through the three otherwise)
+int medianPrediction(int left, int up, int upLeft)
+{
+    if(upLeft >= std::max(left, up))
+        return std::min(left, up);
+    if(upLeft <= std::min(left, up))
+        return std::max(left, up);
+    return left + up - upLeft;
+} //End of medianPrediction method
+
+//Method encodeNormalizedRow will compress the next row of the normalized plane (values 0 - 255)
+template<class Cell>
+void encodeNormalizedRow(MapArchive& archive, const Cell* row)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int width = archive.width;
+    bool first = archive.normalizedRows++ == 0;
+    archive.previous.resize(width);
+    int context = 0;
+    for(int col = 0; col < width; col++)
+    {
+        int value = row[col];
+        int up = first ? 0 : archive.previous[col];
+        int left = col > 0 ? row[col - 1] : up;
+        int upLeft = col > 0 && !first ? archive.previous[col - 1] : up;
+        int residual = (value - medianPrediction(left, up, upLeft)) & 0xFF;
+        encodeTree(archive.normalized, &archive.model.residual[context * 256], residual);
+        int size = std::min(residual, 256 - residual);
+        context = size == 0 ? 0 : size < 8 ? 1 : 2;
+    }
+    for(int col = 0; col < width; col++)
+        archive.previous[col] = row[col];
+    if(archive.normalizedRows == archive.height)
+        archive.normalized.finish();
+    archive.seconds += secondsSince(start);
+} //End of encodeNormalizedRow method
+
+//Method decodeNormalizedRow will read back one row coded by encodeNormalizedRow (above is 0 for the first row)
+void decodeNormalizedRow(RangeDecoder& decoder, MapModel& model, const int* above, int* row, int width)
+{
+    int context = 0;
+    for(int col = 0; col < width; col++)
+    {
+        int up = above ? above[col] : 0;
+        int left = col > 0 ? row[col - 1] : up;
+        int upLeft = col > 0 && above ? above[col - 1] : up;
+        int residual = decodeTree(decoder, &model.residual[context * 256]);
+        row[col] = (medianPrediction(left, up, upLeft) + residual) & 0xFF;
+        int size = std::min(residual, 256 - residual);
+        context = size == 0 ? 0 : size < 8 ? 1 : 2;
+    }
+} //End of decodeNormalizedRow method
+
+//Method encodeTerrainRow will compress the next row of the terrain plane as glyph runs
+void encodeTerrainRow(MapArchive& archive, const char* row)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int width = archive.width;
+    unsigned char context = archive.rowStart;
+    for(int col = 0; col < width; )
+    {
+        unsigned char glyph = row[col];
+        int end = col + 1;
+        while(end < width && (unsigned char) row[end] == glyph)
+            end++;
+        encodeTree(archive.terrain, &archive.model.glyph[context * 256], glyph);
+        encodeRunLength(archive.terrain, archive.model, end - col);
+        context = glyph;
+        col = end;
+    }
+    archive.rowStart = row[0];
+    if(++archive.terrainRows == archive.height)
+        archive.terrain.finish();
+    archive.seconds += secondsSince(start);
+} //End of encodeTerrainRow method
+
+//Method decodeTerrainRow will read back one row coded by encodeTerrainRow
+void decodeTerrainRow(RangeDecoder& decoder, MapModel& model, unsigned char& rowStart, char* row, int width)
+{
+    unsigned char context = rowStart;
+    for(int col = 0; col < width; )
+    {
+        unsigned char glyph = decodeTree(decoder, &model.glyph[context * 256]);
+        unsigned int length = decodeRunLength(decoder, model);
+        if(length > (unsigned int) (width - col))
+            length = width - col; //only a damaged file gets here
+        memset(row + col, glyph, length);
+        context = glyph;
+        col += length;
+    }
+    rowStart = row[0];
+} //End of decodeTerrainRow method
+
+//Method writeArchive will write the header and both compressed sections, once every row has been coded
+bool writeArchive(MapArchive& archive, const char* fileName)
+{
+    if(archive.normalizedRows != archive.height || archive.terrainRows != archive.height)
+        return false;
+    ArchiveHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "ISLZ", 4);
+    header.version = 1;
+    header.width = archive.width;
+    header.height = archive.height;
+    header.normalizedBytes = archive.normalized.bytes.size();
+    header.terrainBytes = archive.terrain.bytes.size();
+    FILE* file = fopen(fileName, "wb");
+    if(!file)
+    {
+        printf("Error -- Could not write %s.\n", fileName);
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+           && fwrite(archive.normalized.bytes.data(), 1, header.normalizedBytes, file) == header.normalizedBytes
+           && fwrite(archive.terrain.bytes.data(), 1, header.terrainBytes, file) == header.terrainBytes;
+    ok = fclose(file) == 0 && ok;
+    if(!ok)
+        printf("Error -- Could not write %s.\n", fileName);
+    return ok;
+} //End of writeArchive method
+
+//Method decodeArchive will read a --compress file and print its normalized grid and island like a normal run does
+bool decodeArchive(const char* fileName, const TerrainPalette& palette, OutputWriter& output)
+{
+    FILE* file = fopen(fileName, "rb");
+    ArchiveHeader header;
+    vector<unsigned char> data;
+    bool ok = file && fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, "ISLZ", 4) == 0
+           && header.version == 1 && header.width > 0 && header.height > 0
+           && header.normalizedBytes + header.terrainBytes < (1ULL << 40);
+    if(ok)
+    {
+        data.resize(header.normalizedBytes + header.terrainBytes);
+        ok = fread(data.data(), 1, data.size(), file) == data.size();
+    }
+    if(file)
+        fclose(file);
+    if(!ok)
+    {
+        printf("Error -- %s is not a compressed island file.\n", fileName);
+        return false;
+    }
+
+    int width = header.width, height = header.height;
+    MapModel model;
+    RangeDecoder normalizedDecoder(data.data(), header.normalizedBytes);
+    vector<int> normalized((size_t) width * height);
+    vector<int*> normalizedRows(height);
+    for(int row = 0; row < height; row++)
+    {
+        normalizedRows[row] = &normalized[(size_t) row * width];
+        decodeNormalizedRow(normalizedDecoder, model, row > 0 ? normalizedRows[row - 1] : 0, normalizedRows[row], width);
+    }
+    output.print(OUTPUT_BOTH, "Normalized Grid:\n");
+    printGrid(normalizedRows.data(), width, height, output);
+
+    RangeDecoder terrainDecoder(data.data() + header.normalizedBytes, header.terrainBytes);
+    vector<char> terrain((size_t) width * height);
+    vector<char*> terrainRows(height);
+    unsigned char rowStart = 0;
+    for(int row = 0; row < height; row++)
+    {
+        terrainRows[row] = &terrain[(size_t) row * width];
+        decodeTerrainRow(terrainDecoder, model, rowStart, terrainRows[row], width);
+    }
+    printIsland(terrainRows.data(), width, height, palette, output);
+    return true;
+} //End of decodeArchive method
+
+//Method startPyramid will size every level of the pyramid, down to a single cell
+//normalizeMap and generateIsland fill level 0 as they go, reducePyramid builds the rest from it
+void startPyramid(MapPyramid& pyramid, int width, int height)
+{
+    pyramid.levels.clear();
+    while(true)
+    {
+        PyramidLevel level;
+        level.width = width;
+        level.height = height;
+        size_t cells = (size_t) width * height;
+        level.maxHeight.resize(cells);
+        if(!pyramid.levels.empty())
+            level.meanHeight.resize(cells);
+        level.terrain.resize(cells);
+        pyramid.levels.push_back(std::move(level));
+        if(width == 1 && height == 1)
+            break;
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+    }
+} //End of startPyramid method
+
+//Method reducePyramid will build each level from the 2x2 blocks of the one below: the highest and the rounded mean
+//height, and the most common glyph. Blocks on an odd edge have only the cells that exist
+void reducePyramid(MapPyramid& pyramid, int threads)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(size_t index = 1; index < pyramid.levels.size(); index++)
+    {
+        const PyramidLevel& below = pyramid.levels[index - 1];
+        PyramidLevel& level = pyramid.levels[index];
+        const unsigned char* belowMean = below.meanHeight.empty() ? below.maxHeight.data() : below.meanHeight.data();
+        parallelBands(level.height, std::min(threads, level.height), [&](int, int firstRow, int endRow)
+        {
+            for(int row = firstRow; row < endRow; row++)
+            {
+                int rows = 2 * row + 1 < below.height ? 2 : 1;
+                for(int col = 0; col < level.width; col++)
+                {
+                    int cols = 2 * col + 1 < below.width ? 2 : 1;
+                    int highest = 0, sum = 0, count = 0;
+                    unsigned char glyphs[4];
+                    for(int dy = 0; dy < rows; dy++)
+                    {
+                        for(int dx = 0; dx < cols; dx++)
+                        {
+                            size_t cell = (size_t) (2 * row + dy) * below.width + 2 * col + dx;
+                            highest = std::max(highest, (int) below.maxHeight[cell]);
+                            sum += belowMean[cell];
+                            glyphs[count++] = below.terrain[cell];
+                        }
+                    }
+                    size_t cell = (size_t) row * level.width + col;
+                    level.maxHeight[cell] = highest;
+                    level.meanHeight[cell] = (sum + count / 2) / count;
+                    level.terrain[cell] = modeOfBlock(glyphs, count);
+                }
+            }
+        });
+    }
+    pyramid.seconds = secondsSince(start);
+} //End of reducePyramid method
+
+//Method modeOfBlock will pick the most common of up to four glyphs, the first one in reading order on a tie
+unsigned char modeOfBlock(const unsigned char* glyphs, int count)
+{
+    unsigned char best = glyphs[0];
+    int bestCount = 0;
+    for(int i = 0; i < count; i++)
+    {
+        int matches = 0;
+        for(int j = 0; j < count; j++)
+            matches += glyphs[j] == glyphs[i];
+        if(matches > bestCount)
+        {
+            best = glyphs[i];
+            bestCount = matches;
+        }
+    }
+    return best;
+} //End of modeOfBlock method
+
+//Method writePyramid will write the header, the level table and every plane of the pyramid to a file
+bool writePyramid(const MapPyramid& pyramid, const char* fileName)
+{
+    const unsigned long long PAGE = 4096;
+    PyramidHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "ISLP", 4);
+    header.version = 1;
+    header.width = pyramid.levels[0].width;
+    header.height = pyramid.levels[0].height;
+    header.levels = pyramid.levels.size();
+
+    //Lay the planes out first, each on the next page boundary
+    vector<PyramidEntry> entries(pyramid.levels.size());
+    vector<std::pair<unsigned long long, const vector<unsigned char>*> > planes;
+    unsigned long long offset = sizeof(header) + entries.size() * sizeof(PyramidEntry);
+    for(size_t index = 0; index < pyramid.levels.size(); index++)
+    {
+        const PyramidLevel& level = pyramid.levels[index];
+        PyramidEntry& entry = entries[index];
+        memset(&entry, 0, sizeof(entry));
+        entry.width = level.width;
+        entry.height = level.height;
+        const vector<unsigned char>* levelPlanes[3] = {&level.maxHeight, &level.meanHeight, &level.terrain};
+        unsigned long long* offsets[3] = {&entry.maxOffset, &entry.meanOffset, &entry.terrainOffset};
+        for(int plane = 0; plane < 3; plane++)
+        {
+            if(levelPlanes[plane]->empty())
+            {
+                *offsets[plane] = entry.maxOffset; //level 0's mean is its max
+                continue;
+            }
+            offset = (offset + PAGE - 1) / PAGE * PAGE;
+            *offsets[plane] = offset;
+            planes.push_back(std::make_pair(offset, levelPlanes[plane]));
+            offset += levelPlanes[plane]->size();
+        }
+    }
+
+    FILE* file = fopen(fileName, "wb");
+    if(!file)
+    {
+        printf("Error -- Could not write %s.\n", fileName);
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+           && fwrite(entries.data(), sizeof(PyramidEntry), entries.size(), file) == entries.size();
+    for(size_t plane = 0; ok && plane < planes.size(); plane++)
+    {
+        ok = fseek(file, (long) planes[plane].first, SEEK_SET) == 0
+          && fwrite(planes[plane].second->data(), 1, planes[plane].second->size(), file) == planes[plane].second->size();
+    }
+    ok = fclose(file) == 0 && ok;
+    if(!ok)
+        printf("Error -- Could not write %s.\n", fileName);
+    return ok;
+} //End of writePyramid method
+
+//Method findMax will search and find the largest number in a 2D int array
+int findMax(int** map, int width, int height)
+{
+    int largest = map[0][0];
+    for(int row = 0; row < height; row++)
+    {
+        for(int col = 0; col < width; col++)
+        {
+            if(map[row][col] > largest)
+                largest = map[row][col];
+        }
+    }
+    return largest;
+} //End of findMax method
+
+//Method moveExists will check if a valid move exists on a particular coordinate
+bool moveExists(int** map, int width, int height, int x, int y, int newX, int newY)
+{
+    if((x >= 0 && x < width) && (y >= 0 && y < height) && (newX >= 0 && newX < width) && (newY >= 0 && newY < height) ) //Checks bounds
+        if(map[newY][newX] <= map[y][x]) //Checks if the direction is smaller or equal to the current point
+            return true;
+
+    return false;
+} //End of moveExists method
+
+//Method generateIsland will classify the normalized map into terrain glyphs, print it and return the 2D char array
+char** generateIsland(int** map, int width, int height, int waterLine, const TerrainPalette& palette, MapArchive* archive, MapPyramid* pyramid, OutputWriter& output)
+{
+    //Dynmatically create a 2D char array for the island generation
+    char** island;
+    island = new char*[height];
+    for(int row = 0; row < height; row++)
+    {
+        island[row] = new char[width];
+    }
+
+    //2D Char array with it's elements assigned by the palette
+    classifyTerrain(palette, map, island, width, height, waterLine);
+    for(int row = 0; archive && row < height; row++)
+        encodeTerrainRow(*archive, island[row]);
+    for(int row = 0; pyramid && row < height; row++)
+        memcpy(&pyramid->levels[0].terrain[(size_t) row * width], island[row], width);
+
+    printIsland(island, width, height, palette, output);
+    return island;
+} //End of generateIsland method
+
+//Method classifyTerrain will assign every cell the glyph of its terrain class
+//The palette thresholds are turned into a glyph for each of the 256 normalized values first, so any palette costs a
+//single lookup per cell
+void classifyTerrain(const TerrainPalette& palette, int** map, char** island, int width, int height, int waterLine)
+{
+    char glyphs[256];
+    glyphTable(palette, waterLine, glyphs);
+    for(int row = 0; row < height; row++)
+    {
+        for(int col = 0; col < width; col++)
+            island[row][col] = glyphs[map[row][col] & 0xFF]; //normalized values are 0 - 255
+    }
+} //End of classifyTerrain method
+
+//Method glyphTable will work out the glyph of each of the 256 normalized values for a waterline
+void glyphTable(const TerrainPalette& palette, int waterLine, char glyphs[256])
+{
+    int landZone = 255 - waterLine;
+    size_t first = 0;
+    while(first < palette.classes.size() && palette.classes[first].water)
+        first++;
+    for(int value = 0; value < 256; value++)
+    {
+        //Walk the classes of the value's zone until one of them takes it, the zone's last class takes the rest
+        size_t begin = value <= waterLine ? 0 : first;
+        size_t end = value <= waterLine ? first : palette.classes.size();
+        size_t pick = end - 1;
+        for(size_t k = begin; k + 1 < end; k++)
+        {
+            const TerrainClass& terrain = palette.classes[k];
+            if(value < (terrain.water ? terrain.threshold * waterLine : waterLine + (terrain.threshold * landZone)))
+            {
+                pick = k;
+                break;
+            }
+        }
+        glyphs[value] = palette.classes[pick].glyph;
+    }
+} //End of glyphTable method
+
+#ifdef ISLAND_FUSED_PIPELINE
+//Method fusedPipeline will normalize, classify and write out the map in a single pass over it, in bands of rows
+//Every normalized line is 4 * width + 1 bytes and every island line width + 1, so each band knows where its lines go in
+//island.txt and --image and writes them there with pwrite as it makes them; no terrain map is ever built. The console
+//is a stream, so each band keeps its console text (the --view blocks it pools, or its full rows without --view) and
+//the bands' texts are printed in order at the end. With --view the bands are cut on block boundaries of both views
+//Returns false, after saying so, when island.txt or the --image file could not be written in full
+bool fusedPipeline(int** map, int width, int height, int waterLine, const TerrainPalette& palette, int threads, MapPyramid* pyramid, FILE* image, OutputWriter& output)
+{
+    //The one pass over the counts before the fused one: the highest count, per band
+    vector<int> bandMax(threads, 0);
+    parallelBands(height, threads, [&](int band, int firstRow, int endRow)
+    {
+        for(int row = firstRow; row < endRow; row++)
+        {
+            for(int col = 0; col < width; col++)
+                bandMax[band] = std::max(bandMax[band], map[row][col]);
+        }
+    });
+    int maxVal = *std::max_element(bandMax.begin(), bandMax.end());
+    if(maxVal <= 0)
+        maxVal = 1;
+    char glyphs[256];
+    glyphTable(palette, waterLine, glyphs);
+    bool colored = _internal::is_colorized(cout);
+
+    //Cut the rows into segments no pooled block crosses
+    ViewWindow gridWindow, islandWindow;
+    bool gridViewed = output.view.enabled && resolveView(output.view, width, height, 4, gridWindow);
+    bool islandViewed = output.view.enabled && resolveView(output.view, width, height, 1, islandWindow);
+    vector<int> bounds(1, 0);
+    if(gridViewed || islandViewed)
+    {
+        const ViewWindow& window = gridViewed ? gridWindow : islandWindow;
+        long long step = window.factor; //the least common multiple of the two factors
+        while(gridViewed && islandViewed && (step % gridWindow.factor != 0 || step % islandWindow.factor != 0))
+            step += window.factor;
+        for(long long row = window.y; row < window.endY; row += step)
+        {
+            if(row > bounds.back())
+                bounds.push_back(row);
+        }
+        if(window.endY > bounds.back())
+            bounds.push_back(window.endY);
+    }
+    else
+    {
+        for(int row = 1; row < height; row++)
+            bounds.push_back(row);
+    }
+    if(height > bounds.back())
+        bounds.push_back(height);
+    int segments = bounds.size() - 1;
+
+    //Everything before the normalized grid has to be in the file before the bands write past it
+    output.print(OUTPUT_BOTH, "Normalized Grid:\n");
+    output.drain();
+    const char* islandTitle = "\nPolished Island:\n";
+    long long lineBytes = 4LL * width + 1, islandLineBytes = width + 1LL;
+    long long textBase = output.file ? ftello(output.file) : 0;
+    long long islandBase = textBase + height * lineBytes + strlen(islandTitle);
+    int text = output.file ? fileno(output.file) : -1;
+    int picture = image ? fileno(image) : -1;
+    long long imageBase = image ? ftello(image) : 0;
+    bool textWritten = text < 0 || writeAt(text, islandTitle, strlen(islandTitle), textBase + height * lineBytes);
+
+    int bands = std::min(threads, segments);
+    vector<std::string> gridConsole(bands), islandConsole(bands);
+    vector<int> textErrors(bands, textWritten ? 0 : errno), imageErrors(bands, 0); //errno of a band's failed write
+    parallelBands(segments, bands, [&](int band, int firstSegment, int endSegment)
+    {
+        GridPool gridPool;
+        GlyphPool glyphPool;
+        if(gridViewed)
+            gridPool.start(gridWindow);
+        if(islandViewed)
+            glyphPool.start(islandWindow, palette, colored);
+        std::string numbers, line;
+        vector<unsigned char> rgb(image ? 3 * (size_t) width : 0);
+        for(int row = bounds[firstSegment]; row < bounds[endSegment]; row++)
+        {
+            int* cells = map[row];
+            numbers.clear();
+            line.clear();
+            for(int col = 0; col < width; col++)
+            {
+                int value = ((double) cells[col] / maxVal) * 255; //This will normalize a coordinate to 255
+                cells[col] = value;
+                appendCell(numbers, value);
+                line += glyphs[value];
+            }
+            numbers += '\n';
+            line += '\n';
+
+            //File sinks: island.txt, --image and --pyramid level 0
+            if(text >= 0 && textErrors[band] == 0)
+            {
+                if(!writeAt(text, numbers.data(), numbers.size(), textBase + row * lineBytes)
+                   || !writeAt(text, line.data(), line.size(), islandBase + row * islandLineBytes))
+                    textErrors[band] = errno;
+            }
+            if(picture >= 0 && imageErrors[band] == 0)
+            {
+                imageRow(palette, line.data(), width, rgb.data());
+                if(!writeAt(picture, rgb.data(), rgb.size(), imageBase + row * (long long) rgb.size()))
+                    imageErrors[band] = errno;
+            }
+            if(pyramid)
+            {
+                unsigned char* heights = &pyramid->levels[0].maxHeight[(size_t) row * width];
+                for(int col = 0; col < width; col++)
+                    heights[col] = cells[col];
+                memcpy(&pyramid->levels[0].terrain[(size_t) row * width], line.data(), width);
+            }
+
+            //The console
+            if(output.view.enabled)
+            {
+                if(gridViewed)
+                    gridPool.addRow(row, cells, gridConsole[band]);
+                if(islandViewed)
+                    glyphPool.addRow(row, line.data(), islandConsole[band]);
+            }
+            else
+            {
+                gridConsole[band] += numbers;
+                if(colored)
+                {
+                    for(int col = 0; col < width; col++)
+                        islandConsole[band] += palette.cells[(unsigned char) line[col]];
+                    islandConsole[band] += '\n';
+                }
+                else
+                    islandConsole[band] += line;
+            }
+        }
+    });
+
+    //Continue the file after the island and put the console text out in order
+    if(output.file)
+        fseeko(output.file, islandBase + height * islandLineBytes, SEEK_SET);
+    if(image)
+        fseeko(image, imageBase + 3LL * width * height, SEEK_SET);
+    if(output.view.enabled)
+        announceView(output, width, height, gridWindow, gridViewed);
+    for(int band = 0; band < bands; band++)
+        output.append(OUTPUT_CONSOLE, gridConsole[band].data(), gridConsole[band].size());
+    output.append(OUTPUT_CONSOLE, islandTitle, strlen(islandTitle));
+    if(output.view.enabled)
+        announceView(output, width, height, islandWindow, islandViewed);
+    for(int band = 0; band < bands; band++)
+        output.append(OUTPUT_CONSOLE, islandConsole[band].data(), islandConsole[band].size());
+
+    int textError = *std::max_element(textErrors.begin(), textErrors.end());
+    int imageError = *std::max_element(imageErrors.begin(), imageErrors.end());
+    if(textError != 0)
+        printf("Error -- Could not write island.txt: %s.\n", strerror(textError));
+    if(imageError != 0)
+        printf("Error -- Could not write the --image file: %s.\n", strerror(imageError));
+    return textError == 0 && imageError == 0;
+} //End of fusedPipeline method
+
+//Method writeAt will write all of data at offset in a file, going on after short writes and interrupted calls
+//Returns false when the file refuses the rest (a full disk, for example), with errno saying why
+bool writeAt(int fd, const void* data, size_t bytes, long long offset)
+{
+    const char* next = (const char*) data;
+    while(bytes > 0)
+    {
+        ssize_t written = pwrite(fd, next, bytes, offset);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written <= 0)
+        {
+            if(written == 0)
+                errno = ENOSPC;
+            return false;
+        }
+        next += written;
+        bytes -= written;
+        offset += written;
+    }
+    return true;
+} //End of writeAt method
+#endif
+
+//Method startImage will open an --image file and write its binary PPM header
+bool startImage(const char* fileName, int width, int height, FILE*& image)
+{
+    image = fopen(fileName, "wb");
+    if(!image)
+    {
+        printf("Error -- Could not write %s.\n", fileName);
+        return false;
+    }
+    fprintf(image, "P6\n%d %d\n255\n", width, height);
+    return true;
+} //End of startImage method
+
+//Method imageRow will color a row of glyphs with the background colors of their terrain classes
+void imageRow(const TerrainPalette& palette, const char* glyphs, int width, unsigned char* rgb)
+{
+    for(int col = 0; col < width; col++)
+        memcpy(rgb + 3 * col, palette.rgb[(unsigned char) glyphs[col]], 3);
+} //End of imageRow method
+
+//Method writeImage will write the island into an --image file, row by row, and close it
+void writeImage(char** island, int width, int height, const TerrainPalette& palette, FILE* image)
+{
+    vector<unsigned char> rgb(3 * (size_t) width);
+    for(int row = 0; island && row < height; row++)
+    {
+        imageRow(palette, island[row], width, rgb.data());
+        fwrite(rgb.data(), 1, rgb.size(), image);
+    }
+    if(fclose(image) != 0)
+        printf("Error -- Could not write the --image file.\n");
+} //End of writeImage method
+
+//Method schemePalette will fill in the palette of a built-in terrain scheme, with the original glyphs and colors
+template<class Scheme>
+void schemePalette(TerrainPalette& palette)
+{
+    palette.classes.clear();
+    palette.classes.push_back({true, Scheme::deep, '#', "blue", "blue"});         //Deep Water
+    palette.classes.push_back({true, 1, '~', "cyan", "cyan"});                    //Shallow Water
+    palette.classes.push_back({false, Scheme::beach, '.', "white", "yellow"});    //Coast/Beach
+    palette.classes.push_back({false, Scheme::grass, '-', "green", "bright_green"}); //Plains/Grass
+    palette.classes.push_back({false, Scheme::forest, '*', "green", "green"});    //Forests
+    palette.classes.push_back({false, 1, '^', "white", "bright_grey"});           //Mountains
+} //End of schemePalette method
+
+//Method loadPalette will read a palette file: one class per line, water classes first and each zone in increasing
+//threshold order, as
+//  water|land threshold glyph foreground background
+//where the colors are termcolor names or #rrggbb. Blank lines and lines starting with // are skipped
+//Prints what is wrong and returns false for a file that can't be used
+bool loadPalette(const char* fileName, TerrainPalette& palette)
+{
+    std::ifstream file(fileName);
+    if(!file)
+    {
+        printf("Error -- Could not open palette file %s.\n", fileName);
+        return false;
+    }
+    palette.classes.clear();
+    std::string line;
+    int lineNumber = 0;
+    bool waterClasses = true;
+    while(std::getline(file, line))
+    {
+        lineNumber++;
+        std::istringstream fields(line);
+        std::string zone, glyph, escape;
+        TerrainClass terrain;
+        if(!(fields >> zone) || zone.compare(0, 2, "//") == 0)
+            continue;
+        bool valid = (zone == "water" || zone == "land") && (fields >> terrain.threshold) && (fields >> glyph)
+                  && (fields >> terrain.foreground) && (fields >> terrain.background) && glyph.size() == 1
+                  && glyph[0] > ' ' && terrain.threshold >= 0 && terrain.threshold <= 1
+                  && renderColor(terrain.foreground, false, escape, 0) && renderColor(terrain.background, true, escape, 0);
+        terrain.water = zone == "water";
+        terrain.glyph = glyph.empty() ? 0 : glyph[0];
+        if(valid && terrain.water && !waterClasses)
+        {
+            printf("Error -- Palette %s line %d: water classes have to come before land classes.\n", fileName, lineNumber);
+            return false;
+        }
+        for(size_t k = 0; valid && k < palette.classes.size(); k++)
+            valid = palette.classes[k].glyph != terrain.glyph;
+        if(!valid)
+        {
+            printf("Error -- Palette %s line %d: expected \"water|land threshold(0-1) glyph foreground background\" with a new glyph and known colors.\n", fileName, lineNumber);
+            return false;
+        }
+        waterClasses = terrain.water;
+        palette.classes.push_back(terrain);
+    }
+    size_t waterCount = 0;
+    while(waterCount < palette.classes.size() && palette.classes[waterCount].water)
+        waterCount++;
+    if(waterCount == 0 || waterCount == palette.classes.size())
+    {
+        printf("Error -- Palette %s needs at least one water and one land class.\n", fileName);
+        return false;
+    }
+    return true;
+} //End of loadPalette method
+
+//Method renderColor will turn a palette color into its escape sequence: a termcolor color name, rendered through
+//termcolor itself, or #rrggbb as a 24-bit color. Returns false for a color it doesn't know
+//rgb, when given, gets the color as RGB (the usual xterm values for the names)
+bool renderColor(const std::string& name, bool background, std::string& escape, unsigned char* rgb)
+{
+    typedef std::ostream& (*Manipulator)(std::ostream&);
+    struct NamedColor { const char* name; Manipulator foreground, background; unsigned char rgb[3]; };
+    static const NamedColor colors[] =
+    {
+        {"grey", grey, on_grey, {0, 0, 0}}, {"red", red, on_red, {205, 0, 0}}, {"green", green, on_green, {0, 205, 0}},
+        {"yellow", yellow, on_yellow, {205, 205, 0}}, {"blue", blue, on_blue, {0, 0, 238}},
+        {"magenta", magenta, on_magenta, {205, 0, 205}}, {"cyan", cyan, on_cyan, {0, 205, 205}},
+        {"white", white, on_white, {229, 229, 229}}, {"bright_grey", bright_grey, on_bright_grey, {127, 127, 127}},
+        {"bright_red", bright_red, on_bright_red, {255, 0, 0}}, {"bright_green", bright_green, on_bright_green, {0, 255, 0}},
+        {"bright_yellow", bright_yellow, on_bright_yellow, {255, 255, 0}},
+        {"bright_blue", bright_blue, on_bright_blue, {92, 92, 255}},
+        {"bright_magenta", bright_magenta, on_bright_magenta, {255, 0, 255}},
+        {"bright_cyan", bright_cyan, on_bright_cyan, {0, 255, 255}},
+        {"bright_white", bright_white, on_bright_white, {255, 255, 255}}
+    };
+    unsigned int r, g, b;
+    char extra;
+    if(name.size() == 7 && sscanf(name.c_str(), "#%2x%2x%2x%c", &r, &g, &b, &extra) == 3)
+    {
+        char sequence[32];
+        snprintf(sequence, sizeof(sequence), "\033[%d;2;%u;%u;%um", background ? 48 : 38, r, g, b);
+        escape = sequence;
+        if(rgb)
+        {
+            rgb[0] = r;
+            rgb[1] = g;
+            rgb[2] = b;
+        }
+        return true;
+    }
+    for(size_t k = 0; k < sizeof(colors) / sizeof(colors[0]); k++)
+    {
+        if(name == colors[k].name)
+        {
+            std::ostringstream sequence;
+            sequence << colorize << (background ? colors[k].background : colors[k].foreground);
+            escape = sequence.str();
+            if(rgb)
+                memcpy(rgb, colors[k].rgb, 3);
+            return true;
+        }
+    }
+    return false;
+} //End of renderColor method
+
+//Method compilePalette will fill in the per-glyph tables of a palette: which glyphs are water, the beach glyph, the
+//pre-rendered console cell of every class and the hash of its classification
+void compilePalette(TerrainPalette& palette)
+{
+    std::ostringstream resetSequence;
+    resetSequence << colorize << reset;
+    unsigned long long hash = 14695981039346656037ULL;
+    palette.beach = 0;
+    for(int glyph = 0; glyph < 256; glyph++)
+    {
+        palette.water[glyph] = false;
+        palette.cells[glyph] = std::string(1, (char) glyph);
+        palette.rgb[glyph][0] = palette.rgb[glyph][1] = palette.rgb[glyph][2] = 0;
+    }
+    for(size_t k = 0; k < palette.classes.size(); k++)
+    {
+        const TerrainClass& terrain = palette.classes[k];
+        unsigned char glyph = terrain.glyph;
+        std::string foreground, background;
+        renderColor(terrain.foreground, false, foreground, 0);
+        renderColor(terrain.background, true, background, palette.rgb[glyph]);
+        palette.water[glyph] = terrain.water;
+        palette.cells[glyph] = background + foreground + (char) glyph + resetSequence.str();
+        if(!terrain.water && palette.beach == 0)
+            palette.beach = glyph;
+
+        char key[64];
+        int length = snprintf(key, sizeof(key), "%d %.17g %d;", terrain.water, terrain.threshold, glyph);
+        for(int i = 0; i < length; i++)
+        {
+            hash ^= (unsigned char) key[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+    palette.hash = (unsigned int) (hash ^ (hash >> 32));
+} //End of compilePalette method
+
+//Method printIsland will print and color a 2D char array of terrain glyphs to the console and island.txt
+//Each row is put together from the palette's pre-rendered cells; the file gets the bare glyphs
+void printIsland(char** island, int width, int height, const TerrainPalette& palette, OutputWriter& output)
+{
+    if(output.muted)
+        return;
+    output.print(OUTPUT_BOTH, "Polished Island:\n");
+    bool colored = _internal::is_colorized(cout);
+    if(output.view.enabled)
+    {
+        printIslandView(island, width, height, palette, output);
+        return;
+    }
+    formatRows(height, width + 1, output, [&](int row, BandText& text)
+    {
+        if(colored)
+        {
+            text.file.append(island[row], width);
+            text.file += '\n';
+            for(int col = 0; col < width; col++)
+                text.console += palette.cells[(unsigned char) island[row][col]];
+            text.console += '\n';
+        }
+        else
+        {
+            text.both.append(island[row], width);
+            text.both += '\n';
+        }
+    }, [](int, int) {});
+} //End of printIsland method
+
+//Method printGrid will print out any 2D int arrays (Used for raw grid and normalized grid)
+//Byte grids (the normalized plane of a cache entry) print the same way
+//With --view the console gets the view instead, max-pooled in the same pass over the rows
+template<class Cell>
+void printGrid(Cell** map, int width, int height, OutputWriter& output)
+{
+    if(output.muted)
+        return;
+    ViewWindow window;
+    bool viewed = beginView(output, width, height, 4, window);
+    bool fileOnly = output.view.enabled;
+    std::string pooledLine;
+    GridPool pool;
+    if(viewed)
+        pool.start(window);
+    formatRows(height, 4 * (size_t) width + 1, output, [&](int row, BandText& text)
+    {
+        std::string& line = fileOnly ? text.file : text.both;
+        for(int col = 0; col < width; col++)
+            appendCell(line, (int) map[row][col]);
+        line += '\n';
+    }, [&](int firstRow, int endRow)
+    {
+        for(int row = firstRow; viewed && row < endRow; row++)
+        {
+            pooledLine.clear();
+            if(pool.addRow(row, map[row], pooledLine))
+                output.append(OUTPUT_CONSOLE, pooledLine.data(), pooledLine.size());
+        }
+    });
+    output.append(OUTPUT_BOTH, "\n", 1);
+} //End of printGrid method
+
+//Method printIslandView will print the island to island.txt and only the --view window to the console
+//Each console character is the most common glyph of its block, counted in one pass over the rows
+void printIslandView(char** island, int width, int height, const TerrainPalette& palette, OutputWriter& output)
+{
+    ViewWindow window;
+    bool viewed = beginView(output, width, height, 1, window);
+    std::string pooledLine;
+    GlyphPool pool;
+    if(viewed)
+        pool.start(window, palette, _internal::is_colorized(cout));
+    formatRows(height, width + 1, output, [&](int row, BandText& text)
+    {
+        text.file.append(island[row], width);
+        text.file += '\n';
+    }, [&](int firstRow, int endRow)
+    {
+        for(int row = firstRow; viewed && row < endRow; row++)
+        {
+            pooledLine.clear();
+            if(pool.addRow(row, island[row], pooledLine))
+                output.append(OUTPUT_CONSOLE, pooledLine.data(), pooledLine.size());
+        }
+    });
+} //End of printIslandView method
+
+//Method start will size a grid pool for its window
+void GridPool::start(const ViewWindow& viewWindow)
+{
+    window = viewWindow;
+    pooled.assign(window.columns, INT_MIN);
+} //End of start method
+
+//Method addRow will pool one map row; when it completes a row of blocks, that row is appended to line and true returned
+template<class Cell>
+bool GridPool::addRow(int row, const Cell* values, std::string& line)
+{
+    if(row < window.y || row >= window.endY)
+        return false;
+    for(int col = window.x; col < window.endX; col++)
+    {
+        int& block = pooled[(col - window.x) / window.factor];
+        block = std::max(block, (int) values[col]);
+    }
+    if((row - window.y + 1) % window.factor != 0 && row + 1 != window.endY)
+        return false;
+    for(int col = 0; col < window.columns; col++)
+        appendCell(line, pooled[col]);
+    line += '\n';
+    std::fill(pooled.begin(), pooled.end(), INT_MIN);
+    return true;
+} //End of addRow method
+
+//Method start will size a glyph pool for its window
+void GlyphPool::start(const ViewWindow& viewWindow, const TerrainPalette& terrainPalette, bool coloredCells)
+{
+    window = viewWindow;
+    palette = &terrainPalette;
+    colored = coloredCells;
+    counts.assign((size_t) window.columns * 256, 0);
+    mode.assign(window.columns, 0);
+    modeCount.assign(window.columns, 0);
+} //End of start method
+
+//Method addRow will count one island row; when it completes a row of blocks, that row is appended to line and true
+//returned
+bool GlyphPool::addRow(int row, const char* glyphs, std::string& line)
+{
+    if(row < window.y || row >= window.endY)
+        return false;
+    for(int col = window.x; col < window.endX; col++)
+    {
+        int block = (col - window.x) / window.factor;
+        unsigned char glyph = glyphs[col];
+        unsigned int count = ++counts[(size_t) block * 256 + glyph];
+        if(count > modeCount[block])
+        {
+            modeCount[block] = count;
+            mode[block] = glyph;
+        }
+    }
+    if((row - window.y + 1) % window.factor != 0 && row + 1 != window.endY)
+        return false;
+    for(int col = 0; col < window.columns; col++)
+    {
+        if(colored)
+            line += palette->cells[mode[col]];
+        else
+            line += (char) mode[col];
+    }
+    line += '\n';
+    std::fill(counts.begin(), counts.end(), 0);
+    std::fill(modeCount.begin(), modeCount.end(), 0);
+    return true;
+} //End of addRow method
+
+//Method beginView will resolve the --view window for a map and announce it on the console
+//cellWidth is how many characters one value takes; false when the console gets nothing of this map
+bool beginView(OutputWriter& output, int width, int height, int cellWidth, ViewWindow& window)
+{
+    if(!output.view.enabled)
+        return false;
+    bool viewed = resolveView(output.view, width, height, cellWidth, window);
+    announceView(output, width, height, window, viewed);
+    return viewed;
+} //End of beginView method
+
+//Method resolveView will work out the cells and the block size of a --view window for one map
+bool resolveView(const ConsoleView& view, int width, int height, int cellWidth, ViewWindow& window)
+{
+    if(view.fit)
+    {
+        //whole map, smallest block that fits the terminal (keeping two lines for the header and the note)
+        int columns = std::max(view.columns / cellWidth, 1), rows = std::max(view.rows - 2, 1);
+        window.x = window.y = 0;
+        window.endX = width;
+        window.endY = height;
+        window.factor = std::max((width + columns - 1) / columns, (height + rows - 1) / rows);
+    }
+    else
+    {
+        window.x = std::min(view.x, width);
+        window.y = std::min(view.y, height);
+        window.endX = (int) std::min<long long>((long long) view.x + view.width, width);
+        window.endY = (int) std::min<long long>((long long) view.y + view.height, height);
+        window.factor = view.factor;
+    }
+    window.factor = std::max(window.factor, 1);
+    window.columns = (window.endX - window.x + window.factor - 1) / window.factor;
+    window.rows = (window.endY - window.y + window.factor - 1) / window.factor;
+    return window.columns > 0 && window.rows > 0;
+} //End of resolveView method
+
+//Method announceView will tell on the console which part of the map the view shows
+void announceView(OutputWriter& output, int width, int height, const ViewWindow& window, bool viewed)
+{
+    if(!viewed)
+        output.print(OUTPUT_CONSOLE, "(--view is outside the %dx%d map; see island.txt)\n", width, height);
+    else
+        output.print(OUTPUT_CONSOLE, "(columns %d-%d, rows %d-%d of %dx%d, %dx%d cells each; full map in island.txt)\n",
+                     window.x, window.endX - 1, window.y, window.endY - 1, width, height, window.factor, window.factor);
+} //End of announceView method
+
+//Method parseView will read a --view argument: x,y,w,h with an optional ,factor, or fit
+bool parseView(const char* text, ConsoleView& view)
+{
+    view.enabled = true;
+    if(strcmp(text, "fit") == 0)
+    {
+        view.fit = true;
+#if defined(ISLAND_TERMINAL_SIZE)
+        struct winsize size;
+        if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 && size.ws_row > 0)
+        {
+            view.columns = size.ws_col;
+            view.rows = size.ws_row;
+            return true;
+        }
+#elif defined(_WIN32)
+        //windows.h comes in through termcolor.hpp; the visible window, not the scrollback buffer, is what has to fit
+        CONSOLE_SCREEN_BUFFER_INFO console;
+        if(GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &console))
+        {
+            view.columns = console.srWindow.Right - console.srWindow.Left + 1;
+            view.rows = console.srWindow.Bottom - console.srWindow.Top + 1;
+            return true;
+        }
+#endif
+        const char* columns = getenv("COLUMNS");
+        const char* rows = getenv("LINES");
+        if(columns && atoi(columns) > 0)
+            view.columns = atoi(columns);
+        if(rows && atoi(rows) > 0)
+            view.rows = atoi(rows);
+        return true;
+    }
+    char extra;
+    int fields = sscanf(text, "%d,%d,%d,%d,%d%c", &view.x, &view.y, &view.width, &view.height, &view.factor, &extra);
+    return (fields == 4 || fields == 5) && view.x >= 0 && view.y >= 0 && view.width > 0 && view.height > 0 && view.factor > 0;
+} //End of parseView method
+
+//Method appendCell will add one grid value to a line the way setw(3) << value << " " prints it
+void appendCell(std::string& line, int value)
+{
+    char digits[16];
+    int length = 0;
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int) value : (unsigned int) value;
+    do
+    {
+        digits[length++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while(magnitude != 0);
+    if(value < 0)
+        digits[length++] = '-';
+    for(int pad = length; pad < 3; pad++)
+        line += ' ';
+    while(length > 0)
+        line += digits[--length];
+    line += ' ';
+} //End of appendCell method
+
+//Method OutputWriter will open the output file and start the writer thread
+//A null file name makes a muted writer that drops everything and starts no thread
+OutputWriter::OutputWriter(const char* fileName)
+{
+    file = fileName ? fopen(fileName, "wb") : 0;
+    for(int slot = 0; slot < SLOTS; slot++)
+        slots[slot].target = 0;
+    muted = !fileName;
+    if(muted)
+        return;
+    fflush(stdout); //anything printed before the writer starts stays ahead of it
+    worker = std::thread(&OutputWriter::run, this);
+} //End of OutputWriter method
+
+//Method ~OutputWriter will write out whatever is left and close the output file
+OutputWriter::~OutputWriter()
+{
+    close();
+    if(file)
+        fclose(file);
+} //End of ~OutputWriter method
+
+//Method append will add text to the buffers of the targets, handing a buffer to the writer once it holds a chunk
+void OutputWriter::append(int targets, const char* text, size_t length)
+{
+    if(muted)
+        return;
+    for(int target = 0; target < 2; target++)
+    {
+        if(!(targets & (1 << target)))
+            continue;
+        pending[target].append(text, length);
+        if(pending[target].size() >= CHUNK)
+            submit(target);
+    }
+} //End of append method
+
+//Method print will append printf-style formatted text to the targets
+void OutputWriter::print(int targets, const char* format, ...)
+{
+    char text[512];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if(length > 0)
+        append(targets, text, std::min((size_t) length, sizeof(text) - 1));
+} //End of print method
+
+//Method submit will queue the buffer of one target (0 console, 1 file) and take back an empty one
+//Blocks while every slot is still queued
+void OutputWriter::submit(int target)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    written.wait(guard, [this]() { return count < SLOTS; });
+    Slot& slot = slots[(head + count) % SLOTS];
+    slot.target = target;
+    slot.data.swap(pending[target]);
+    count++;
+    guard.unlock();
+    queued.notify_one();
+} //End of submit method
+
+//Method drain will hand over the partly filled buffers and wait until everything queued has been written
+void OutputWriter::drain()
+{
+    for(int target = 0; target < 2; target++)
+    {
+        if(!pending[target].empty())
+            submit(target);
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    written.wait(guard, [this]() { return count == 0; });
+} //End of drain method
+
+//Method close will drain the queue and stop the writer thread
+void OutputWriter::close()
+{
+    if(!worker.joinable())
+        return;
+    drain();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closing = true;
+    }
+    queued.notify_one();
+    worker.join();
+} //End of close method
+
+//Method run is the writer thread: it writes the queued slots in order, flushing after each so that a finished
+//drain means the bytes have left the process
+void OutputWriter::run()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while(true)
+    {
+        queued.wait(guard, [this]() { return count > 0 || closing; });
+        if(count == 0)
+            break;
+        Slot& slot = slots[head];
+        guard.unlock();
+        FILE* stream = slot.target == 0 ? stdout : file;
+        if(stream)
+        {
+            fwrite(slot.data.data(), 1, slot.data.size(), stream);
+            fflush(stream);
+        }
+        slot.data.clear();
+        guard.lock();
+        head = (head + 1) % SLOTS;
+        count--;
+        written.notify_all();
+    }
+} //End of run method
+
+//Generate a random number between 0-1
+float frand()
+{
+    return (float) (rand() % RAND_MAX) / (float) RAND_MAX;
+} //End of frand method
+
+#ifdef ISLANDGEN_LIBRARY
+//The C interface of libislandgen.so, declared in islandgen.h
+//The context keeps each plane in one contiguous block with a row pointer array into it, so the stages run on the
+//same int** and char** rows as in the executable and the blocks can be handed out as they are
+
+//Struct islandgen_context is everything one map needs between calls: its parameters, its planes and its stats
+struct islandgen_context
+{
+    int width = 0, height = 0;
+    int xCor = 0, yCor = 0, zoneRadius = 2;
+    bool dropZoneStale = false;  //the grid shrank past the drop zone, which has to be set again before a walk
+    int particleNum = 0, particleLife = 0;
+    int waterLine = 0;           //0 until set, and picked by the normalize stage with a land fraction
+    double landFraction = -1;
+    unsigned int seed = 0;
+    int threads = 1;
+    WalkOptions walk;
+    SmoothOptions smooth;
+    TerrainPalette palette;
+    int stagesRun = 0;           //stages run since the parameters they depend on last changed
+    vector<int> raw, normalized;
+    vector<char> terrain;
+    vector<int*> rawRows, normalizedRows;
+    vector<char*> terrainRows;
+    RunStats stats;
+    double walkSeconds = 0, normalizeSeconds = 0, classifySeconds = 0;
+};
+
+//Method forgetStages will drop the stages from the given one on, after a parameter they depend on changed
+static void forgetStages(islandgen_context* context, int stage)
+{
+    context->stagesRun = std::min(context->stagesRun, stage);
+} //End of forgetStages method
+
+//Method guardedCall will run the body of an entry point and turn any C++ exception into a status, since none may
+//cross the C interface: running out of memory, or of threads for the worker bands, is ISLANDGEN_ERROR_MEMORY
+template<class Body>
+static int guardedCall(Body body)
+{
+    try
+    {
+        return body();
+    }
+    catch(...)
+    {
+        return ISLANDGEN_ERROR_MEMORY;
+    }
+} //End of guardedCall method
+
+extern "C" int islandgen_abi_version(void)
+{
+    return ISLANDGEN_ABI_VERSION;
+}
+
+extern "C" const char* islandgen_status_string(int status)
+{
+    switch(status)
+    {
+        case ISLANDGEN_OK: return "ok";
+        case ISLANDGEN_ERROR_ARGUMENT: return "invalid argument";
+        case ISLANDGEN_ERROR_ORDER: return "stage run out of order";
+        case ISLANDGEN_ERROR_MEMORY: return "out of memory";
+    }
+    return "unknown status";
+}
+
+extern "C" islandgen_context* islandgen_create(void)
+{
+    islandgen_context* context = new (std::nothrow) islandgen_context;
+    if(!context)
+        return 0;
+    try
+    {
+        context->threads = std::thread::hardware_concurrency() > 0 ? std::thread::hardware_concurrency() : 1;
+        context->seed = time(0);
+        schemePalette<ClassicTerrain>(context->palette);
+        compilePalette(context->palette);
+    }
+    catch(...)
+    {
+        delete context;
+        return 0;
+    }
+    return context;
+}
+
+extern "C" void islandgen_destroy(islandgen_context* context)
+{
+    delete context;
+}
+
+extern "C" int islandgen_set_grid(islandgen_context* context, int32_t width, int32_t height)
+{
+    return guardedCall([&]()
+    {
+        if(!context || width <= 0 || height <= 0)
+            return ISLANDGEN_ERROR_ARGUMENT;
+        try
+        {
+            size_t cells = (size_t) width * height;
+            context->raw.assign(cells, 0);
+            context->normalized.assign(cells, 0);
+            context->terrain.assign(cells, 0);
+            context->rawRows.resize(height);
+            context->normalizedRows.resize(height);
+            context->terrainRows.resize(height);
+        }
+        catch(const std::bad_alloc&)
+        {
+            context->raw.clear();
+            context->normalized.clear();
+            context->terrain.clear();
+            context->width = context->height = 0;
+            return ISLANDGEN_ERROR_MEMORY;
+        }
+        for(int row = 0; row < height; row++)
+        {
+            context->rawRows[row] = &context->raw[(size_t) row * width];
+            context->normalizedRows[row] = &context->normalized[(size_t) row * width];
+            context->terrainRows[row] = &context->terrain[(size_t) row * width];
+        }
+        context->width = width;
+        context->height = height;
+        if(context->xCor > width || context->yCor > height
+           || (width >= 2 && height >= 2 && (context->zoneRadius > width || context->zoneRadius > height)))
+            context->dropZoneStale = true; //past the limits islandgen_set_drop_zone checks
+        forgetStages(context, ISLANDGEN_STAGE_WALK);
+        return ISLANDGEN_OK;
+    });
+}
+
+extern "C" int islandgen_set_drop_zone(islandgen_context* context, int32_t x, int32_t y, int32_t radius)
+{
+    return guardedCall([&]()
+    {
+        if(!context || context->width <= 0)
+            return ISLANDGEN_ERROR_ORDER;
+        int width = context->width, height = context->height;
+        if(width < 2 || height < 2)
+            radius = 2; //the only radius a one-cell-wide grid takes, as in the executable
+        else if(radius < 2 || radius > width || radius > height)
+            return ISLANDGEN_ERROR_ARGUMENT;
+        if(x < 0 || x > width || y < 0 || y > height)
+            return ISLANDGEN_ERROR_ARGUMENT;
+        context->xCor = x;
+        context->yCor = y;
+        context->zoneRadius = radius;
+        context->dropZoneStale = false;
+        forgetStages(context, ISLANDGEN_STAGE_WALK);
+        return ISLANDGEN_OK;
+    });
+}
+
+extern "C" int islandgen_set_particles(islandgen_context* context, int32_t count, int32_t life)
+{
+    return guardedCall([&]()
+    {
+        if(!context || count < 0 || life < 0)
+            return ISLANDGEN_ERROR_ARGUMENT;
+        context->particleNum = count;
+        context->particleLife = life;
+        forgetStages(context, ISLANDGEN_STAGE_WALK);
+        return ISLANDGEN_OK;
+    });
+}
+
+extern "C" int islandgen_set_water_line(islandgen_context* context, int32_t water_line)
+{
+    return guardedCall([&]()
+    {
+        if(!context || water_line < 40 || water_line > 200)
+            return ISLANDGEN_ERROR_ARGUMENT;
+        context->waterLine = water_line;
+        context->landFraction = -1;
+        forgetStages(context, ISLANDGEN_STAGE_CLASSIFY);
+        return ISLANDGEN_OK;
+    });
+}
+
+extern "C" int islandgen_set_seed(islandgen_context* context, uint32_t seed)
+{
+    return guardedCall([&]()
+    {
+        if(!context)
+            return ISLANDGEN_ERROR_ARGUMENT;
+        context->seed = seed;
+        forgetStages(context, ISLANDGEN_STAGE_WALK);
+        return ISLANDGEN_OK;
+    });
+}
+
+//The option names and values are those of the command line, and so are their limits
+extern "C" int islandgen_set_option(islandgen_context* context, const char* name, const char* value)
+{
+    return guardedCall([&]()
+    {
+        if(!context || !name || !value)
+            return ISLANDGEN_ERROR_ARGUMENT;
+        bool valid = true;
+        int stage = ISLANDGEN_STAGE_WALK; //the first stage the option changes
+        WalkOptions& walk = context->walk;
+        SmoothOptions& smooth = context->smooth;
+        if(strcmp(name, "layout") == 0)
+        {
+            if(strcmp(value, "rows") == 0)
+                walk.layout = LAYOUT_ROWS;
+            else if(strcmp(value, "tile8") == 0)
+                walk.layout = LAYOUT_TILE8;
+            else if(strcmp(value, "tile16") == 0)
+                walk.layout = LAYOUT_TILE16;
+            else if(strcmp(value, "morton") == 0)
+                walk.layout = LAYOUT_MORTON;
+            else
+                valid = false;
+        }
+        else if(strcmp(name, "neighborhood") == 0)
+        {
+            if(strcmp(value, Moore8::name) == 0)
+                walk.neighborhood = NEIGHBORHOOD_MOORE;
+            else if(strcmp(value, VonNeumann4::name) == 0)
+                walk.neighborhood = NEIGHBORHOOD_VON_NEUMANN;
+            else if(strcmp(value, Hex6::name) == 0)
+                walk.neighborhood = NEIGHBORHOOD_HEX;
+            else
+                valid = false;
+        }
+        else if(strcmp(name, "terrain") == 0 || strcmp(name, "palette") == 0)
+        {
+            TerrainPalette palette;
+            if(strcmp(name, "palette") == 0)
+                valid = loadPalette(value, palette);
+            else if(strcmp(value, ClassicTerrain::name) == 0)
+                schemePalette<ClassicTerrain>(palette);
+            else if(strcmp(value, HighlandsTerrain::name) == 0)
+                schemePalette<HighlandsTerrain>(palette);
+            else if(strcmp(value, LowlandsTerrain::name) == 0)
+                schemePalette<LowlandsTerrain>(palette);
+            else
+                valid = false;
+            if(valid)
+            {
+                compilePalette(palette);
+                context->palette = palette;
+            }
+            stage = ISLANDGEN_STAGE_CLASSIFY;
+        }
+        else if(strcmp(name, "walkers") == 0)
+        {
+            int walkers = atoi(value);
+            valid = walkers == 0 || walkers == 8 || walkers == 16;
+            if(valid)
+                walk.walkers = walkers;
+        }
+        else if(strcmp(name, "ordered-walkers") == 0)
+            walk.orderedWalkers = atoi(value) != 0;
+        else if(strcmp(name, "smooth") == 0)
+        {
+            if(strcmp(value, "none") == 0)
+                smooth.kernel = SMOOTH_NONE;
+            else if(strcmp(value, "box") == 0)
+                smooth.kernel = SMOOTH_BOX;
+            else if(strcmp(value, "gauss") == 0)
+                smooth.kernel = SMOOTH_GAUSS;
+            else
+                valid = false;
+            stage = ISLANDGEN_STAGE_NORMALIZE;
+        }
+        else if(strcmp(name, "smooth-radius") == 0)
+        {
+            int radius = atoi(value);
+            valid = radius >= 1 && radius <= MAX_SMOOTH_RADIUS;
+            if(valid)
+                smooth.radius = radius;
+            stage = ISLANDGEN_STAGE_NORMALIZE;
+        }
+        else if(strcmp(name, "erode") == 0)
+        {
+            int iterations = atoi(value);
+            valid = iterations >= 0;
+            if(valid)
+                smooth.erodeIterations = iterations;
+            stage = ISLANDGEN_STAGE_NORMALIZE;
+        }
+        else if(strcmp(name, "land-fraction") == 0)
+        {
+            double fraction = atof(value);
+            valid = fraction > 0 && fraction < 1;
+            if(valid)
+                context->landFraction = fraction;
+            stage = ISLANDGEN_STAGE_NORMALIZE;
+        }
+        else if(strcmp(name, "threads") == 0)
+        {
+            int threads = atoi(value);
+            valid = threads > 0;
+            if(valid)
+                context->threads = threads;
+            stage = ISLANDGEN_STAGE_CLASSIFY + 1; //the same result on any number of threads
+        }
+        else
+            valid = false;
+        if(!valid)
+            return ISLANDGEN_ERROR_ARGUMENT;
+        forgetStages(context, stage);
+        return ISLANDGEN_OK;
+    });
+}
+
+//The stages are the executable's, run through a muted writer so they only fill the planes
+extern "C" int islandgen_run_stage(islandgen_context* context, int stage)
+{
+    return guardedCall([&]()
+    {
+        if(!context || stage < ISLANDGEN_STAGE_WALK || stage > ISLANDGEN_STAGE_CLASSIFY)
+            return ISLANDGEN_ERROR_ARGUMENT;
+        if(context->width <= 0 || stage > context->stagesRun)
+            return ISLANDGEN_ERROR_ORDER;
+        if(stage == ISLANDGEN_STAGE_CLASSIFY && context->waterLine == 0 && context->landFraction < 0)
+            return ISLANDGEN_ERROR_ORDER;
+        if(stage == ISLANDGEN_STAGE_WALK && context->dropZoneStale)
+            return ISLANDGEN_ERROR_ORDER;
+        forgetStages(context, stage); //until it has run in full, in case it fails part way
+        int width = context->width, height = context->height;
+        OutputWriter output(0);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if(stage == ISLANDGEN_STAGE_WALK)
+        {
+            std::fill(context->raw.begin(), context->raw.end(), 0);
+            context->stats = RunStats();
+            srand(context->seed);
+            makeParticleMap(context->rawRows.data(), width, height, context->xCor, context->yCor, context->zoneRadius,
+                            context->particleNum, context->particleLife, context->walk, output, context->stats);
+            context->walkSeconds = secondsSince(start);
+        }
+        else if(stage == ISLANDGEN_STAGE_NORMALIZE)
+        {
+            //The raw plane is kept, the normalized plane starts as a copy of it
+            std::copy(context->raw.begin(), context->raw.end(), context->normalized.begin());
+            if(context->smooth.kernel != SMOOTH_NONE || context->smooth.erodeIterations > 0)
+                smoothMap(context->normalizedRows.data(), width, height, context->smooth, context->threads);
+            long long histogram[256];
+            normalizeMap(context->normalizedRows.data(), width, height, context->threads, histogram, 0, 0, output);
+            if(context->landFraction >= 0)
+                context->waterLine = chooseWaterLine(histogram, (long long) width * height, context->landFraction);
+            context->normalizeSeconds = secondsSince(start);
+        }
+        else
+        {
+            classifyTerrain(context->palette, context->normalizedRows.data(), context->terrainRows.data(), width, height, context->waterLine);
+            context->classifySeconds = secondsSince(start);
+        }
+        context->stagesRun = stage + 1;
+        return ISLANDGEN_OK;
+    });
+}
+
+extern "C" int islandgen_run(islandgen_context* context)
+{
+    return guardedCall([&]()
+    {
+        for(int stage = ISLANDGEN_STAGE_WALK; stage <= ISLANDGEN_STAGE_CLASSIFY; stage++)
+        {
+            int status = islandgen_run_stage(context, stage);
+            if(status != ISLANDGEN_OK)
+                return status;
+        }
+        return ISLANDGEN_OK;
+    });
+}
+
+extern "C" int islandgen_get_plane(const islandgen_context* context, int plane, islandgen_plane* view)
+{
+    return guardedCall([&]()
+    {
+        if(!context || !view || plane < ISLANDGEN_PLANE_RAW || plane > ISLANDGEN_PLANE_TERRAIN)
+            return ISLANDGEN_ERROR_ARGUMENT;
+        if(context->stagesRun <= plane) //each plane is the output of the stage with its number
+            return ISLANDGEN_ERROR_ORDER;
+        view->width = context->width;
+        view->height = context->height;
+        if(plane == ISLANDGEN_PLANE_TERRAIN)
+        {
+            view->data = context->terrain.data();
+            view->element_size = 1;
+        }
+        else
+        {
+            view->data = plane == ISLANDGEN_PLANE_RAW ? context->raw.data() : context->normalized.data();
+            view->element_size = sizeof(int);
+        }
+        view->stride = (int64_t) context->width * view->element_size;
+        return ISLANDGEN_OK;
+    });
+}
+
+extern "C" int islandgen_get_stats(const islandgen_context* context, islandgen_stats* stats)
+{
+    return guardedCall([&]()
+    {
+        if(!context || !stats)
+            return ISLANDGEN_ERROR_ARGUMENT;
+        memset(stats, 0, sizeof(*stats));
+        if(context->stagesRun > ISLANDGEN_STAGE_WALK)
+        {
+            stats->particles = context->stats.particles;
+            stats->steps = context->stats.steps;
+            stats->dead_end_kills = context->stats.deadEndKills;
+            stats->walk_seconds = context->walkSeconds;
+        }
+        if(context->stagesRun > ISLANDGEN_STAGE_NORMALIZE)
+            stats->normalize_seconds = context->normalizeSeconds;
+        if(context->stagesRun > ISLANDGEN_STAGE_CLASSIFY)
+            stats->classify_seconds = context->classifySeconds;
+        stats->water_line = context->waterLine;
+        return ISLANDGEN_OK;
+    });
+}
+#endif
@@ -0,0 +1,108 @@
+/*
+islandgen.h -- C interface of libislandgen.so, the island generator as a library
+
+Build: g++ -O2 -shared -fPIC -fvisibility=hidden -pthread -DISLANDGEN_LIBRARY -o libislandgen.so island_generator.cpp
+
+A context holds the parameters and the three planes of one map. The parameters are set, the stages are run in order
+(walk, normalize, classify), and each plane is then read in place through islandgen_get_plane. Nothing is written to
+the console or to island.txt.
+
+Buffer lifetime: the planes belong to the context. They are allocated by islandgen_set_grid and stay at the same
+address until the next islandgen_set_grid or islandgen_destroy. Running a stage again overwrites its plane in place.
+A caller can wrap a plane as a NumPy array or a Go slice once and keep it while the context lives.
+
+Threads: a context may be used from any thread, one call at a time. The walk draws from the C library's rand(), so
+only one context in the process may run the walk at a time.
+*/
+
+#ifndef ISLANDGEN_H
+#define ISLANDGEN_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define ISLANDGEN_API __attribute__((visibility("default")))
+#else
+#define ISLANDGEN_API
+#endif
+
+/* Bumped whenever a function or struct here changes in a way old callers would notice */
+#define ISLANDGEN_ABI_VERSION 1
+
+/* Status codes returned by the functions below */
+#define ISLANDGEN_OK 0
+#define ISLANDGEN_ERROR_ARGUMENT 1  /* a parameter is out of range or an option is unknown */
+#define ISLANDGEN_ERROR_ORDER 2     /* a stage ran before the one it needs, or a plane was asked for before it exists */
+#define ISLANDGEN_ERROR_MEMORY 3    /* the planes, or a stage's working memory or threads, could not be allocated */
+
+/* Stages, in the order they have to run */
+#define ISLANDGEN_STAGE_WALK 0      /* drops the particles: fills the raw plane */
+#define ISLANDGEN_STAGE_NORMALIZE 1 /* smooths (when set) and normalizes the raw counts to 0 - 255: the normalized plane */
+#define ISLANDGEN_STAGE_CLASSIFY 2  /* turns the normalized plane into terrain glyphs: the terrain plane */
+
+/* Planes */
+#define ISLANDGEN_PLANE_RAW 0        /* int32 particle counts */
+#define ISLANDGEN_PLANE_NORMALIZED 1 /* int32 heights, 0 - 255 */
+#define ISLANDGEN_PLANE_TERRAIN 2    /* one byte per cell, the glyph of its terrain class */
+
+typedef struct islandgen_context islandgen_context;
+
+/* A read-only view of a plane: row r starts at data + r * stride bytes */
+typedef struct islandgen_plane
+{
+    const void* data;
+    int32_t width;
+    int32_t height;
+    int64_t stride;       /* bytes from one row to the next */
+    int32_t element_size; /* bytes per cell: 4 for the raw and normalized planes, 1 for terrain */
+} islandgen_plane;
+
+/* Counters and timings of the stages that ran */
+typedef struct islandgen_stats
+{
+    int64_t particles;       /* particles dropped */
+    int64_t steps;           /* valid moves made by all particles */
+    int64_t dead_end_kills;  /* particles killed on a dead end before their life ran out */
+    int32_t water_line;      /* waterline the terrain was classified with (picked when land_fraction is set) */
+    double walk_seconds;
+    double normalize_seconds;
+    double classify_seconds;
+} islandgen_stats;
+
+ISLANDGEN_API int islandgen_abi_version(void);
+ISLANDGEN_API const char* islandgen_status_string(int status);
+
+/* Returns 0 when out of memory. The context starts with the classic terrain, one thread per core and no planes */
+ISLANDGEN_API islandgen_context* islandgen_create(void);
+ISLANDGEN_API void islandgen_destroy(islandgen_context* context);
+
+/* The same parameters, with the same limits, as the executable asks for on stdin. A grid that shrinks past the drop
+   zone set for it makes the walk return ISLANDGEN_ERROR_ORDER until the drop zone is set again */
+ISLANDGEN_API int islandgen_set_grid(islandgen_context* context, int32_t width, int32_t height);
+ISLANDGEN_API int islandgen_set_drop_zone(islandgen_context* context, int32_t x, int32_t y, int32_t radius);
+ISLANDGEN_API int islandgen_set_particles(islandgen_context* context, int32_t count, int32_t life);
+ISLANDGEN_API int islandgen_set_water_line(islandgen_context* context, int32_t water_line);
+ISLANDGEN_API int islandgen_set_seed(islandgen_context* context, uint32_t seed);
+
+/* Any of the executable's walk, terrain and smoothing options by name, without the dashes:
+   layout, neighborhood, terrain, palette, walkers, ordered-walkers, smooth, smooth-radius, erode, land-fraction,
+   threads. Flags take "1" or "0" */
+ISLANDGEN_API int islandgen_set_option(islandgen_context* context, const char* name, const char* value);
+
+/* Runs one stage. Every stage before it must have run since the last change to the parameters it depends on */
+ISLANDGEN_API int islandgen_run_stage(islandgen_context* context, int stage);
+/* Runs every stage */
+ISLANDGEN_API int islandgen_run(islandgen_context* context);
+
+ISLANDGEN_API int islandgen_get_plane(const islandgen_context* context, int plane, islandgen_plane* view);
+ISLANDGEN_API int islandgen_get_stats(const islandgen_context* context, islandgen_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,71 @@
+/*
+islandgen_test.c -- checks of the libislandgen.so C interface
+
+Build and run next to the library:
+g++ -O2 -shared -fPIC -fvisibility=hidden -pthread -DISLANDGEN_LIBRARY -o libislandgen.so island_generator.cpp
+gcc -O2 -o islandgen_test islandgen_test.c -L. -lislandgen -Wl,-rpath,'$ORIGIN' && ./islandgen_test
+
+Exits with 0 when every check passes and prints the first one that fails otherwise.
+*/
+
+#include <stdio.h>
+#include "islandgen.h"
+
+#define CHECK(condition) \
+    do { if(!(condition)) { printf("islandgen_test: %s:%d: %s failed\n", __FILE__, __LINE__, #condition); return 1; } } while(0)
+
+int main(void)
+{
+    islandgen_context* context = islandgen_create();
+    islandgen_stats stats;
+    islandgen_plane plane;
+    CHECK(context != 0);
+    CHECK(islandgen_abi_version() == ISLANDGEN_ABI_VERSION);
+
+    /* The stages have to run in order, and the planes only exist once their stage has run */
+    CHECK(islandgen_run_stage(context, ISLANDGEN_STAGE_WALK) == ISLANDGEN_ERROR_ORDER);
+    CHECK(islandgen_set_grid(context, 120, 60) == ISLANDGEN_OK);
+    CHECK(islandgen_set_drop_zone(context, 60, 30, 25) == ISLANDGEN_OK);
+    CHECK(islandgen_set_particles(context, 20000, 60) == ISLANDGEN_OK);
+    CHECK(islandgen_set_water_line(context, 90) == ISLANDGEN_OK);
+    CHECK(islandgen_set_seed(context, 9) == ISLANDGEN_OK);
+    CHECK(islandgen_run_stage(context, ISLANDGEN_STAGE_NORMALIZE) == ISLANDGEN_ERROR_ORDER);
+    CHECK(islandgen_get_plane(context, ISLANDGEN_PLANE_RAW, &plane) == ISLANDGEN_ERROR_ORDER);
+
+    /* The walk fills the raw plane and reports its counters and its time */
+    CHECK(islandgen_run_stage(context, ISLANDGEN_STAGE_WALK) == ISLANDGEN_OK);
+    CHECK(islandgen_get_stats(context, &stats) == ISLANDGEN_OK);
+    CHECK(stats.particles == 20000);
+    CHECK(stats.steps > 0);
+    CHECK(stats.walk_seconds > 0);
+    CHECK(islandgen_get_plane(context, ISLANDGEN_PLANE_RAW, &plane) == ISLANDGEN_OK);
+    CHECK(plane.width == 120 && plane.height == 60 && plane.element_size == 4 && plane.stride == 480);
+
+    /* The other two stages, and their planes */
+    CHECK(islandgen_run(context) == ISLANDGEN_OK);
+    CHECK(islandgen_get_stats(context, &stats) == ISLANDGEN_OK);
+    CHECK(stats.walk_seconds > 0 && stats.normalize_seconds > 0 && stats.classify_seconds > 0);
+    CHECK(stats.water_line == 90);
+    CHECK(islandgen_get_plane(context, ISLANDGEN_PLANE_TERRAIN, &plane) == ISLANDGEN_OK);
+    CHECK(plane.element_size == 1 && plane.stride == 120);
+
+    /* Bad arguments are refused without touching the context */
+    CHECK(islandgen_set_grid(context, 0, 60) == ISLANDGEN_ERROR_ARGUMENT);
+    CHECK(islandgen_set_option(context, "walkers", "3") == ISLANDGEN_ERROR_ARGUMENT);
+    CHECK(islandgen_set_option(context, "no-such-option", "1") == ISLANDGEN_ERROR_ARGUMENT);
+    CHECK(islandgen_get_plane(context, ISLANDGEN_PLANE_NORMALIZED, &plane) == ISLANDGEN_OK);
+
+    /* A grid that shrinks past the drop zone needs a new drop zone before it can walk, instead of walking forever */
+    CHECK(islandgen_set_grid(context, 100, 100) == ISLANDGEN_OK);
+    CHECK(islandgen_set_drop_zone(context, 95, 95, 60) == ISLANDGEN_OK);
+    CHECK(islandgen_set_grid(context, 10, 10) == ISLANDGEN_OK);
+    CHECK(islandgen_run(context) == ISLANDGEN_ERROR_ORDER);
+    CHECK(islandgen_set_drop_zone(context, 5, 5, 3) == ISLANDGEN_OK);
+    CHECK(islandgen_run(context) == ISLANDGEN_OK);
+    CHECK(islandgen_get_stats(context, &stats) == ISLANDGEN_OK);
+    CHECK(stats.particles == 20000);
+
+    islandgen_destroy(context);
+    printf("islandgen_test: all checks passed\n");
+    return 0;
+}